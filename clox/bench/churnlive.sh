@@ -0,0 +1,12 @@
+#!/bin/sh
+# Writes churnlive.lox: strchurn.lox behind 100 functions whose 25,000
+# string constants stay interned, so the string table is large and full
+# while the script churns through temporaries.
+awk 'BEGIN {
+  for (f = 0; f < 100; f++) {
+    printf "fun helper%d() {", f
+    for (i = 0; i < 250; i++) printf " \"live%d_%d\";", f, i
+    print " }"
+  }
+}'
+cat "$(dirname "$0")/strchurn.lox"
@@ -0,0 +1,94 @@
+#define _XOPEN_SOURCE 700
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+// Throughput of the Table operations on their own, in ns per call.
+// Built by `make bench` against whichever table the build selects, so
+// `make bench TABLE=swiss` measures src/swisstable.c instead.
+
+#define KEY_COUNT 50000
+#define ROUNDS 200
+#define REPS 5
+
+static ObjString* keys[KEY_COUNT];
+// Keeps the lookups from being optimized away
+static volatile double sink;
+
+static double now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static double benchSet(Table* table) {
+  double start = now();
+  for (int round = 0; round < ROUNDS; round++)
+    for (int i = 0; i < KEY_COUNT; i++)
+      tableSet(table, keys[i], NUMBER_VAL(i));
+  return now() - start;
+}
+
+static double benchGet(Table* table) {
+  double start = now();
+  Value value = NIL_VAL;
+  for (int round = 0; round < ROUNDS; round++)
+    for (int i = 0; i < KEY_COUNT; i++) {
+      tableGet(table, keys[i], &value);
+      sink += AS_NUMBER(value);
+    }
+  return now() - start;
+}
+
+// Looks up every key in the string table, then as many strings that
+// aren't there, as interning does
+static double benchFindString(void) {
+  Table* strings = &get_VM()->strings;
+  double start = now();
+  for (int round = 0; round < ROUNDS / 4; round++) {
+    for (int i = 0; i < KEY_COUNT; i++)
+      sink += tableFindString(strings, keys[i]->chars, keys[i]->length,
+          keys[i]->hash) != NULL;
+    for (int i = 0; i < KEY_COUNT; i++)
+      sink += tableFindString(strings, "missing", 7,
+          keys[i]->hash ^ 0x5bd1e995) != NULL;
+  }
+  return now() - start;
+}
+
+int main(void) {
+  initVM();
+
+  // Creating the keys can trigger collections, and keys[] isn't a
+  // root, so each key is also kept in globalValues, which the
+  // collector marks
+  VM* vm = get_VM();
+  char name[32];
+  for (int i = 0; i < KEY_COUNT; i++) {
+    int length = snprintf(name, sizeof(name), "key%d", i);
+    keys[i] = copyString(name, length);
+    push_back_ValueArray(&vm->globalValues, OBJ_VAL(keys[i]));
+  }
+
+  double set = 1e9, get = 1e9, find = 1e9;
+  for (int rep = 0; rep < REPS; rep++) {
+    Table table;
+    init_Table(&table);
+    set = fmin(set, benchSet(&table));
+    get = fmin(get, benchGet(&table));
+    find = fmin(find, benchFindString());
+    free_Table(&table);
+  }
+
+  double calls = (double) KEY_COUNT * ROUNDS;
+  printf("%d keys, best of %d, ns/op\n", KEY_COUNT, REPS);
+  printf("  tableSet         %6.1f\n", set * 1e9 / calls);
+  printf("  tableGet         %6.1f\n", get * 1e9 / calls);
+  printf("  tableFindString  %6.1f  (half misses)\n", find * 1e9 / (calls / 2));
+
+  freeVM();
+  return 0;
+}
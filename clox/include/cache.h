@@ -0,0 +1,16 @@
+#pragma once
+
+#include "common.h"
+#include "object.h"
+
+// Compiled scripts are cached next to their source as PATH + "c"
+// ("fib.lox" -> "fib.loxc"). A cache is only used when it was written
+// by a build with the same format and opcodes from the exact same
+// source, so a stale or foreign one is just recompiled over.
+
+// Returns the script's function from its cache, or NULL if there is
+// no usable cache. Registers the script's globals as it loads.
+ObjFunction* loadCache(const char* path, const char* source);
+// Best effort: a cache that can't be written is simply not there
+void writeCache(const char* path, const char* source,
+    ObjFunction* function);
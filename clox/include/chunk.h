@@ -26,21 +26,99 @@ typedef enum {
   OP_SET_LOCAL,
   OP_GET_UPVALUE,
   OP_SET_UPVALUE,
+  OP_CLOSE_UPVALUE,
   OP_DEFINE_GLOBAL,
   OP_GET_GLOBAL,
   OP_SET_GLOBAL,
   OP_RETURN,
-  OP_CLOSURE,
+  OP_CLOSURE,             // Followed by (isLocal, index) per upvalue
   OP_CALL,
+  OP_CONSTANT_LONG,       // 16-bit constant index
+  OP_CLOSURE_LONG,
+  // Local functions that never escape their declaring frame
+  OP_SHARED_CLOSURE,      // Pushes a closure constant, skips upvalues
+  OP_GET_OUTER,           // Slots of the calling frame
+  OP_SET_OUTER,
+
+  // Superinstructions, emitted by the compiler in place of the most
+  // frequent opcode sequences
+  OP_GET_LOCAL_2,         // OP_GET_LOCAL a, OP_GET_LOCAL b
+  OP_SET_LOCAL_POP,       // OP_SET_LOCAL, OP_POP
+  OP_ADD_CONSTANT,        // OP_CONSTANT, OP_ADD
+  OP_NOT_EQUAL,           // OP_EQUAL, OP_NOT
+  OP_LESS_EQUAL,          // OP_GREATER, OP_NOT
+  OP_GREATER_EQUAL,       // OP_LESS, OP_NOT
+  OP_POP_JUMP_IF_FALSE,   // OP_JUMP_IF_FALSE, OP_POP on both paths
+  OP_JUMP_IF_NOT_LESS,    // OP_LESS, OP_POP_JUMP_IF_FALSE
+
+  // Immediate forms: a signed 16-bit operand stands in for a number
+  // constant that is a small integer
+  OP_INT,                 // push the operand
+  OP_ADD_INT,             // OP_INT, OP_ADD
+  OP_SUBTRACT_INT,        // OP_INT, OP_SUBTRACT
+  OP_EQUAL_INT,           // OP_INT, OP_EQUAL
+  OP_LESS_INT,            // OP_INT, OP_LESS
+  OP_GREATER_INT,         // OP_INT, OP_GREATER
+  OP_JUMP_IF_NOT_LESS_INT,  // OP_LESS_INT, OP_POP_JUMP_IF_FALSE
+
+  // Register machine, compiled by regcompiler.c and run by regvm.c.
+  // Instructions are four bytes: the opcode then A, B, C, or the
+  // opcode, A and a 16-bit Bx. A is the destination register and B,
+  // C are source registers; the _CONST forms read C from the
+  // constant table instead.
+  OP_REG_MOVE,
+  OP_REG_LOAD_CONSTANT,
+  OP_REG_LOAD_NIL,
+  OP_REG_LOAD_TRUE,
+  OP_REG_LOAD_FALSE,
+  OP_REG_DEFINE_GLOBAL,
+  OP_REG_GET_GLOBAL,
+  OP_REG_SET_GLOBAL,
+  OP_REG_ADD,
+  OP_REG_SUBTRACT,
+  OP_REG_MULTIPLY,
+  OP_REG_DIVIDE,
+  OP_REG_EQUAL,
+  OP_REG_NOT_EQUAL,
+  OP_REG_LESS,
+  OP_REG_LESS_EQUAL,
+  OP_REG_GREATER,
+  OP_REG_GREATER_EQUAL,
+  OP_REG_ADD_CONST,
+  OP_REG_SUBTRACT_CONST,
+  OP_REG_MULTIPLY_CONST,
+  OP_REG_DIVIDE_CONST,
+  OP_REG_EQUAL_CONST,
+  OP_REG_NOT_EQUAL_CONST,
+  OP_REG_LESS_CONST,
+  OP_REG_LESS_EQUAL_CONST,
+  OP_REG_GREATER_CONST,
+  OP_REG_GREATER_EQUAL_CONST,
+  OP_REG_NOT,
+  OP_REG_NEGATE,
+  OP_REG_JUMP,            // Bx is a signed offset from the next instruction
+  OP_REG_JUMP_IF_FALSE,
+  OP_REG_JUMP_IF_TRUE,
+  OP_REG_PRINT,
+  OP_REG_CALL,            // Calls R[A] with B arguments in R[A+1]...
+  OP_REG_RETURN,
+  OP_REG_CLOSURE,
   OP_LAST
 } OpCode;
 
+// Line numbers are run-length encoded: each entry is the first
+// code offset of a run of bytes that share a line
+typedef struct {
+  int offset;
+  int line;
+} LineStart;
+
 VECTOR_DECL(ByteArray, uint8_t)
-VECTOR_DECL(IntArray, int)
+VECTOR_DECL(LineArray, LineStart)
 
 typedef struct {
   ByteArray code;
-  IntArray lines;
+  LineArray lines;
   ValueArray constants;
 } Chunk;
 
@@ -49,4 +127,6 @@ void free_Chunk(Chunk*);
 
 int addConstant(Chunk*, Value value);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+void removeLastByte(Chunk* chunk);
+int getLine(Chunk* chunk, int offset);
 
@@ -10,5 +10,11 @@
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
-#define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
+// Threaded dispatch needs the labels-as-values extension; build with
+// -DNO_COMPUTED_GOTO (make COMPUTED_GOTO=0) to force the portable switch.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// #define DEBUG_STRESS_GC
+// #define DEBUG_LOG_GC
@@ -4,3 +4,10 @@
 #include "object.h"
 
 ObjFunction* compile(const char* source);
+// Compiles the body of a function deferred by --lazy
+bool compileFunction(ObjFunction* function);
+void markCompilerRoots(void);
+
+// Register-machine backend (regcompiler.c)
+ObjFunction* compileRegisters(const char* source);
+void markRegisterCompilerRoots(void);
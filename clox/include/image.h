@@ -0,0 +1,18 @@
+#pragma once
+
+#include "common.h"
+
+// A heap image is a snapshot of the globals and every object they
+// reach, taken after a script has run (--save-image PATH). Booting
+// from one (--image PATH) restores that state without compiling or
+// running the script again: the file is mapped, each object in it is
+// allocated, and the references between objects, which the image
+// stores as object numbers, are fixed up to the new addresses.
+//
+// Functions are stored as compiled, so an image records whether it
+// was saved from the register backend and only boots on that one.
+
+bool saveImage(const char* path, bool registers);
+// Must run on a fresh VM, before anything else is compiled
+bool loadImage(const char* path, bool registers);
+void markImageRoots(void);
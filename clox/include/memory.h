@@ -0,0 +1,90 @@
+#pragma once
+
+#include "common.h"
+#include "object.h"
+#include "vector.h"
+
+#define GC_HEAP_GROW_FACTOR 2
+#ifndef GC_INITIAL_THRESHOLD
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+#endif
+
+#ifdef GC_GENERATIONAL
+// The nursery is resized after every minor collection to keep its
+// pause under vm.gcPauseBudget, within these bounds.
+#define GC_NURSERY_INITIAL (256 * 1024)
+#define GC_NURSERY_MIN (32 * 1024)
+#define GC_NURSERY_MAX (64 * 1024 * 1024)
+#define GC_DEFAULT_PAUSE_BUDGET_NS 1000000
+
+// Must be used whenever a reference is stored into a heap object after
+// it was allocated, so old objects that point at young ones get
+// rescanned by minor collections. Stores into the stack or globals
+// don't need it; those are roots.
+#define WRITE_BARRIER(owner, value) \
+  do { \
+    if ((owner)->isOld && IS_OBJ(value) && !AS_OBJ(value)->isOld) \
+      rememberObject(owner); \
+  } while (false)
+#else
+#define WRITE_BARRIER(owner, value) do { } while (false)
+#endif
+
+// Objects up to POOL_MAX_SIZE bytes come from per-size-class pools
+// carved out of POOL_PAGE_SIZE pages, so allocating is a free-list pop
+// or a pointer bump and related objects end up next to each other.
+#define POOL_GRANULE 16
+#define POOL_CLASS_COUNT 16
+#define POOL_MAX_SIZE (POOL_GRANULE * POOL_CLASS_COUNT)
+#define POOL_PAGE_SIZE (64 * 1024)
+
+typedef struct PoolSlot {
+  struct PoolSlot* next;
+} PoolSlot;
+
+typedef struct PoolPage {
+  struct PoolPage* next;
+  // Keeps the first slot POOL_GRANULE aligned
+  char padding[POOL_GRANULE - sizeof(struct PoolPage*)];
+} PoolPage;
+
+typedef struct {
+  PoolSlot* freeList;
+  char* bump;
+  char* limit;
+} SizeClass;
+
+typedef struct {
+  SizeClass classes[POOL_CLASS_COUNT];
+  PoolPage* pages;
+} ObjectPools;
+
+VECTOR_DECL(GrayStack, Obj*)
+
+typedef struct {
+  int minorCount;
+  int majorCount;
+  uint64_t minorTotalNs;
+  uint64_t minorMaxNs;
+  uint64_t majorTotalNs;
+  uint64_t majorMaxNs;
+  size_t promotedBytes;
+  size_t freedBytes;
+} GCStats;
+
+// Every object and string body goes through reallocate() so the
+// collector can track heap size and trigger a collection once
+// bytesAllocated passes nextGC.
+void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+
+// Fixed-size allocations for objects; small sizes are pooled
+void* allocate(size_t size);
+void deallocate(void* pointer, size_t size);
+void initPools(void);
+void freePools(void);
+
+void markObject(Obj* object);
+void markValue(Value value);
+void rememberObject(Obj* object);
+void collectGarbage(void);
+void printGCStats(void);
@@ -5,35 +5,86 @@
 #include "chunk.h"
 
 typedef enum {
+  OBJ_BUILDER,
   OBJ_CLOSURE,
   OBJ_FUNCTION,
   OBJ_NATIVE,
   OBJ_STRING,
+  OBJ_UPVALUE,
 } ObjType;
 
 struct Obj {
   ObjType type;
+  bool isMarked;
+#ifdef GC_GENERATIONAL
+  bool isOld;
+  bool isRemembered;
+#endif
   struct Obj* next;
 };
 
+// The characters are stored inline so a string is one allocation
 struct ObjString {
   Obj obj;
   int length;
-  char* chars;
   uint32_t hash;
+  char chars[];
 };
 
+// Concatenations at least this long produce a builder instead of
+// an interned string
+#define BUILDER_MIN_LENGTH 64
+
+// Append-only character storage shared by string builders
+typedef struct {
+  int length;
+  int capacity;
+  int refCount;
+  char* chars;
+} StringBuffer;
+
+// A lazily concatenated string: the first `length` characters of a
+// shared buffer. Appending to the builder that ends at the buffer's
+// tip grows the buffer in place, so building a string in a loop is
+// amortized linear. Builders are not interned and compare by content.
+typedef struct {
+  Obj obj;
+  StringBuffer* buffer;
+  int length;
+} ObjBuilder;
+
 typedef struct {
   Obj obj;
   int arity;
   int upvalueCount;
+  int registerCount;      // Frame size for register code
   Chunk chunk;
   ObjString* name;
+  // Until a function deferred by --lazy is first called, its chunk is
+  // empty and its parameter list starts at lazySource->chars +
+  // lazyStart, on line lazyLine
+  ObjString* lazySource;
+  int lazyStart;
+  int lazyLine;
 } ObjFunction;
 
+// A captured variable. While the variable's scope is live the upvalue
+// is open and points at its stack slot; when the scope exits the value
+// moves into `closed` and location points there instead.
+typedef struct ObjUpvalue {
+  Obj obj;
+  Value* location;
+  Value closed;
+  struct ObjUpvalue* next;  // Open upvalues, by descending slot
+} ObjUpvalue;
+
+// The upvalue pointers are stored inline, so a closure is one
+// allocation whatever it captures
 typedef struct {
   Obj obj;
   ObjFunction* function;
+  int upvalueCount;
+  ObjUpvalue* upvalues[];
 } ObjClosure;
 
 typedef Value (*NativeFn)(int argCount, Value* args);
@@ -46,10 +97,17 @@ typedef struct {
 ObjFunction* newFunction(void);
 ObjNative* newNative(NativeFn function);
 ObjClosure* newClosure(ObjFunction* function);
+ObjUpvalue* newUpvalue(Value* slot);
 
-ObjString* takeString(char* chars, int length);
 ObjString* copyString(const char* chars, int length);
+ObjString* concatStrings(ObjString* a, ObjString* b);
+Obj* concatText(Obj* a, Obj* b);
+// A builder with its own copy of `chars`
+ObjBuilder* newBuilder(const char* chars, int length);
+bool objectsEqual(Obj* a, Obj* b);
 
+size_t objectSize(Obj* object);
+void freeObject(Obj* object);
 void freeObjects(void);
 
 static inline bool isObjType(Value value, ObjType type) {
@@ -59,12 +117,16 @@ static inline bool isObjType(Value value, ObjType type) {
 #define OBJ_TYPE(value)       (AS_OBJ(value)->type)
 
 #define IS_STRING(value)      isObjType(value, OBJ_STRING)
+#define IS_BUILDER(value)     isObjType(value, OBJ_BUILDER)
+#define IS_TEXT(value)        (IS_STRING(value) || IS_BUILDER(value))
 #define IS_FUNCTION(value)    isObjType(value, OBJ_FUNCTION)
 #define IS_NATIVE(value)      isObjType(value, OBJ_NATIVE)
 #define IS_CLOSURE(value)     isObjType(value, OBJ_CLOSURE)
+#define IS_UPVALUE(value)     isObjType(value, OBJ_UPVALUE)
 
 #define AS_STRING(value)      ((ObjString*) AS_OBJ(value))
 #define AS_CSTRING(value)     ((AS_STRING(value))->chars)
+#define AS_BUILDER(value)     ((ObjBuilder*) AS_OBJ(value))
 #define AS_FUNCTION(value)    ((ObjFunction*) AS_OBJ(value))
 #define AS_NATIVE(value) \
   (((ObjNative*) AS_OBJ(value))->function)
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "common.h"
+#include "scanner.h"
+
+// The front end shared by the stack compiler (compiler.c) and the
+// register compiler (regcompiler.c): token handling, error reporting
+// and recovery, and the Pratt loop for expressions. A backend plugs
+// into the loop with a table of ParseRules that emit its code.
+
+typedef enum {
+  PREC_NONE,
+  PREC_ASSIGNMENT,  // =
+  PREC_OR,          // or
+  PREC_AND,         // and
+  PREC_EQUALITY,    // == !=
+  PREC_COMPARISON,  // < > <= >=
+  PREC_TERM,        // + -
+  PREC_FACTOR,      // * /
+  PREC_UNARY,       // ! -
+  PREC_CALL,        // . ()
+  PREC_PRIMARY,
+} Precedence;
+
+typedef struct {
+  Token current;
+  Token previous;
+  bool hadError;
+  bool panicMode;
+} Parser;
+
+// `e` is whatever the backend tracks about the expression being
+// compiled; parseExpression passes it through untouched
+typedef void (*ParseFn)(void* e, bool canAssign);
+
+// What a backend does for a token at the start of an expression and
+// after an operand. How tightly operators bind is the same for every
+// backend; see infixPrecedence.
+typedef struct {
+  ParseFn prefix;
+  ParseFn infix;
+} ParseRule;
+
+extern Parser parser;
+
+// Clears the error state and reads the first token of the source the
+// scanner was set up with
+void startParser(void);
+void advanceToken(void);
+void consume(TokenType type, const char* message);
+bool check(TokenType type);
+bool match(TokenType type);
+
+void errorAt(Token* token, const char* message);
+void errorAtCurrent(const char* message);
+void errorAtPrevious(const char* message);
+// Skips to what looks like the start of the next statement
+void synchronize(void);
+
+bool identifiersEqual(Token* a, Token* b);
+
+Precedence infixPrecedence(TokenType type);
+// Compiles an expression whose operators bind at least as tightly as
+// `precedence` using the backend's `rules`. Returns false, having
+// reported it, if there is no expression.
+bool parseExpression(const ParseRule* rules, Precedence precedence,
+    void* e);
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "common.h"
+
+// Opcode profiler, built with `make PROFILE=1`. Both interpreter
+// loops call profileInstruction() before every dispatch; the report
+// is printed to stderr at exit. Time per opcode is the gap between
+// consecutive dispatches (rdtsc cycles on x86, nanoseconds
+// elsewhere), so it includes a roughly constant profiler overhead.
+
+void profileBegin(void);
+void profileInstruction(uint8_t op);
+void printOpcodeProfile(void);
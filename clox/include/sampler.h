@@ -0,0 +1,13 @@
+#pragma once
+
+#include "common.h"
+
+// Sampling profiler, enabled with --sample-profile PATH. A SIGPROF
+// timer records the Lox call stack (vm.frames) every millisecond of
+// CPU time; stopSampler() writes the samples to PATH as collapsed
+// stacks ("<script>:4;fib:1;fib:1 17"), the input format of
+// flamegraph.pl.
+
+bool startSampler(const char* path);
+void stopSampler(void);
+void markSamplerRoots(void);
@@ -32,5 +32,7 @@ typedef struct {
 
 
 void initScanner(const char* source);
+// Scans from partway into a source, `line` being the line it starts on
+void initScannerAt(const char* source, int line);
 
 Token scanToken(void);
@@ -11,8 +11,23 @@ typedef struct {
   Value value;
 } Entry;
 
+#ifdef SWISS_TABLE
+// Swiss-table layout: a control byte per slot holding 7 bits of the
+// key's hash, probed 16 slots at a time, next to the entry array
+typedef struct {
+  int size;
+  int capacity;
+  int growthLeft;
+  uint32_t groupMask;
+  uint8_t* ctrl;
+  Entry* data;
+} Table;
 
+void init_Table(Table* table);
+void free_Table(Table* table);
+#else
 VECTOR_DECL(Table, Entry)
+#endif
 
 bool tableSet(Table* table, ObjString* key, Value value);
 bool tableGet(Table* table, ObjString* key, Value* value);
@@ -20,3 +35,7 @@ bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars,
     int length, uint32_t hash);
+ObjString* tableFindConcat(Table* table, ObjString* a,
+    ObjString* b, uint32_t hash);
+void tableRemoveWhite(Table* table);
+void markTable(Table* table);
@@ -6,11 +6,62 @@
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef NAN_BOXING
+
+// Every non-double value is stored in the payload of a quiet NaN.
+// Objects set the sign bit and keep their 48-bit pointer in the low
+// bits; nil, false and true use the small tags below.
+#define SIGN_BIT    ((uint64_t) 0x8000000000000000)
+#define QNAN        ((uint64_t) 0x7ffc000000000000)
+
+#define TAG_NIL     1 // 01
+#define TAG_FALSE   2 // 10
+#define TAG_TRUE    3 // 11
+#define TAG_UNDEFINED 4 // 100
+
+typedef uint64_t Value;
+
+#define IS_BOOL(value)    (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)     ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_NUMBER(value)  (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) \
+  (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(value)    ((value) == TRUE_VAL)
+#define AS_NUMBER(value)  valueToNum(value)
+#define AS_OBJ(value) \
+  ((Obj*) (uintptr_t) ((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(b)       ((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL         ((Value) (uint64_t) (QNAN | TAG_FALSE))
+#define TRUE_VAL          ((Value) (uint64_t) (QNAN | TAG_TRUE))
+#define NIL_VAL           ((Value) (uint64_t) (QNAN | TAG_NIL))
+#define UNDEFINED_VAL     ((Value) (uint64_t) (QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(num)   numToValue(num)
+#define OBJ_VAL(obj) \
+  (Value) (SIGN_BIT | QNAN | (uint64_t) (uintptr_t) (obj))
+
+static inline double valueToNum(Value value) {
+  double num;
+  memcpy(&num, &value, sizeof(Value));
+  return num;
+}
+
+static inline Value numToValue(double num) {
+  Value value;
+  memcpy(&value, &num, sizeof(double));
+  return value;
+}
+
+#else
+
 typedef enum {
   VAL_BOOL,
   VAL_NIL,
   VAL_NUMBER,
-  VAL_OBJ
+  VAL_OBJ,
+  VAL_UNDEFINED
 } ValueType;
 
 typedef struct {
@@ -26,6 +77,7 @@ typedef struct {
 #define IS_NIL(value)     ((value).type == VAL_NIL)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_BOOL(value)    ((value).as.boolean)
 #define AS_NUMBER(value)  ((value).as.number)
@@ -35,9 +87,19 @@ typedef struct {
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(value)    ((Value){VAL_OBJ, {.obj = (Obj*)value}})
+#define UNDEFINED_VAL     ((Value){VAL_UNDEFINED, {.number = 0}})
+
+#endif
+
+// UNDEFINED_VAL never reaches Lox code; it marks global slots that
+// have been allocated by the compiler but not yet defined.
 
 VECTOR_DECL(ValueArray, Value)
 
+static inline bool isFalsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
 void printValue(Value value);
 void printObject(Value value);
 bool valuesEqual(Value a, Value b);
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "common.h"
+#include "object.h"
+
+// Checks on code read back from a cache or an image, which may have
+// been damaged or planted. The interpreters trust every operand, so
+// a function is only run once it passes: each instruction is a known
+// opcode, constants, globals, locals, upvalues and registers it names
+// exist, jumps land on instructions inside the chunk, and the stack
+// height at each instruction is the same on every path and stays
+// within the frame's share of the stack.
+
+// globalCount is the number of global slots the VM has once loading
+// is done. Nested functions are checked on their own.
+bool verifyFunction(ObjFunction* function, int globalCount,
+    bool registers);
+// Whether the function reads its closure's upvalues, which a shared
+// closure doesn't have
+bool readsUpvalues(ObjFunction* function);
@@ -4,6 +4,7 @@
 #include "value.h"
 #include "table.h"
 #include "object.h"
+#include "memory.h"
 
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
@@ -20,9 +21,35 @@ typedef struct {
 
   Value stack[STACK_MAX];
   Value* stackTop;
-  Table globals;
+  ObjUpvalue* openUpvalues;
+  // Each global name gets a slot in globalValues when it is first
+  // compiled; globalSlots maps names to slot numbers and globalNames
+  // maps them back for error messages.
+  Table globalSlots;
+  ValueArray globalValues;
+  ValueArray globalNames;
   Table strings;
+
+  size_t bytesAllocated;
+  size_t nextGC;
   Obj* objects;
+  GrayStack grayStack;
+  ObjectPools pools;
+#ifdef GC_GENERATIONAL
+  // Young objects live on `nursery` until they survive a collection
+  // and move to `objects`
+  Obj* nursery;
+  size_t nurseryBytes;
+  size_t nurseryLimit;
+  size_t oldBytes;
+  uint64_t gcPauseBudget;
+  GrayStack rememberedSet;
+#endif
+  GCStats gcStats;
+  // Set by --disassemble, --trace and --lazy
+  bool printCode;
+  bool traceExecution;
+  bool lazyFunctions;
 } VM;
 
 typedef enum {
@@ -36,7 +63,16 @@ void freeVM(void);
 
 VM* get_VM(void);
 
+int globalSlot(ObjString* name);
+// Map the VM's natives to their global names and back
+const char* nativeName(NativeFn function);
+NativeFn findNative(const char* name, int length);
+
 InterpretResult interpret(const char* source);
+// Runs an already compiled script, such as one loaded from its cache
+InterpretResult interpretFunction(ObjFunction* function);
+InterpretResult interpretRegisters(const char* source);
+void runtimeError(const char* format, ...);
 
 void push(Value value);
 Value pop(void);
@@ -0,0 +1,369 @@
+#define _XOPEN_SOURCE 700
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cache.h"
+#include "memory.h"
+#include "verify.h"
+#include "vm.h"
+
+// Bump whenever the layout below or the meaning of any opcode changes
+#define CACHE_MAGIC 0x434f4c58u   // "XLOC" read as little endian
+#define CACHE_VERSION 1
+
+// File layout, all in native byte order:
+//   CacheHeader
+//   u32 global count, then each global name as a string, in slot order
+//   the script function
+// A function is its arity, upvalue and register counts, its name
+// (length -1 for none), its code, its line table and its constants.
+// A string is an i32 length and the characters; each constant is a
+// tag byte followed by a double, a string or a function.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t opcodeCount;
+  uint32_t reserved;
+  uint64_t sourceLength;
+  uint64_t sourceHash;
+} CacheHeader;
+
+typedef enum {
+  CONSTANT_NUMBER,
+  CONSTANT_STRING,
+  CONSTANT_FUNCTION,
+  CONSTANT_CLOSURE,   // A closure shared by every execution
+} ConstantTag;
+
+typedef struct {
+  const uint8_t* cursor;
+  const uint8_t* end;
+  bool ok;
+  int globalCount;   // Slots the code may name
+} Reader;
+
+static char* cachePath(const char* path);
+static uint64_t hashSource(const char* source, size_t length);
+static CacheHeader makeHeader(const char* source);
+
+static void writeBytes(ByteArray* out, const void* bytes, size_t size);
+static void writeInt(ByteArray* out, int32_t value);
+static void writeString(ByteArray* out, ObjString* string);
+static void writeFunction(ByteArray* out, ObjFunction* function);
+
+static bool readBytes(Reader* reader, void* bytes, size_t size);
+static int32_t readInt(Reader* reader);
+static ObjString* readString(Reader* reader);
+static ObjFunction* readFunction(Reader* reader);
+static bool readConstant(Reader* reader, Value* value);
+static bool readGlobals(Reader* reader, bool define);
+
+ObjFunction* loadCache(const char* path, const char* source) {
+  char* cache = cachePath(path);
+  int fd = open(cache, O_RDONLY);
+  free(cache);
+  if (fd == -1) return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(CacheHeader)) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t size = (size_t) st.st_size;
+  void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return NULL;
+
+  Reader reader = { data, (const uint8_t*) data + size, true, 0 };
+  CacheHeader header, expected = makeHeader(source);
+  ObjFunction* function = NULL;
+  if (readBytes(&reader, &header, sizeof(header)) &&
+      memcmp(&header, &expected, sizeof(header)) == 0) {
+    Reader names = reader;
+    if (readGlobals(&reader, false)) function = readFunction(&reader);
+    if (function != NULL) {
+      push(OBJ_VAL(function));
+      reader.ok = readGlobals(&names, true);
+      pop();
+    }
+  }
+
+  munmap(data, size);
+  return reader.ok ? function : NULL;
+}
+
+void writeCache(const char* path, const char* source,
+    ObjFunction* function) {
+  ByteArray out;
+  init_ByteArray(&out);
+
+  CacheHeader header = makeHeader(source);
+  writeBytes(&out, &header, sizeof(header));
+
+  ValueArray* names = &get_VM()->globalNames;
+  writeInt(&out, names->size);
+  for (int i = 0; i < names->size; i++)
+    writeString(&out, AS_STRING(names->data[i]));
+
+  writeFunction(&out, function);
+
+  // Written aside and renamed over, so a reader never sees half a file
+  char* cache = cachePath(path);
+  size_t length = strlen(cache);
+  char* temporary = malloc(length + 5);
+  memcpy(temporary, cache, length);
+  memcpy(temporary + length, ".tmp", 5);
+
+  FILE* file = fopen(temporary, "wb");
+  if (file != NULL) {
+    bool written = fwrite(out.data, 1, out.size, file) == (size_t) out.size;
+    if (fclose(file) == 0 && written)
+      rename(temporary, cache);
+    else
+      remove(temporary);
+  }
+
+  free(temporary);
+  free(cache);
+  free_ByteArray(&out);
+}
+
+static char* cachePath(const char* path) {
+  size_t length = strlen(path);
+  char* cache = malloc(length + 2);
+  memcpy(cache, path, length);
+  cache[length] = 'c';
+  cache[length + 1] = '\0';
+  return cache;
+}
+
+// 64-bit FNV-1a
+static uint64_t hashSource(const char* source, size_t length) {
+  uint64_t hash = 14695981039346656037u;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t) source[i];
+    hash *= 1099511628211u;
+  }
+  return hash;
+}
+
+static CacheHeader makeHeader(const char* source) {
+  CacheHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = CACHE_MAGIC;
+  header.version = CACHE_VERSION;
+  header.opcodeCount = OP_LAST;
+  header.sourceLength = strlen(source);
+  header.sourceHash = hashSource(source, header.sourceLength);
+  return header;
+}
+
+static void writeBytes(ByteArray* out, const void* bytes, size_t size) {
+  if (out->size + (int) size > out->capacity)
+    reserve_ByteArray(out, MAX(out->capacity * 2, out->size + (int) size));
+  memcpy(out->data + out->size, bytes, size);
+  out->size += (int) size;
+}
+
+static void writeInt(ByteArray* out, int32_t value) {
+  writeBytes(out, &value, sizeof(value));
+}
+
+static void writeString(ByteArray* out, ObjString* string) {
+  if (string == NULL) {
+    writeInt(out, -1);
+    return;
+  }
+  writeInt(out, string->length);
+  writeBytes(out, string->chars, string->length);
+}
+
+static void writeFunction(ByteArray* out, ObjFunction* function) {
+  writeInt(out, function->arity);
+  writeInt(out, function->upvalueCount);
+  writeInt(out, function->registerCount);
+  writeString(out, function->name);
+
+  Chunk* chunk = &function->chunk;
+  writeInt(out, chunk->code.size);
+  writeBytes(out, chunk->code.data, chunk->code.size);
+  writeInt(out, chunk->lines.size);
+  writeBytes(out, chunk->lines.data, chunk->lines.size * sizeof(LineStart));
+
+  writeInt(out, chunk->constants.size);
+  for (int i = 0; i < chunk->constants.size; i++) {
+    Value constant = chunk->constants.data[i];
+    uint8_t tag;
+    if (IS_NUMBER(constant)) {
+      double number = AS_NUMBER(constant);
+      tag = CONSTANT_NUMBER;
+      writeBytes(out, &tag, 1);
+      writeBytes(out, &number, sizeof(number));
+    } else if (IS_STRING(constant)) {
+      tag = CONSTANT_STRING;
+      writeBytes(out, &tag, 1);
+      writeString(out, AS_STRING(constant));
+    } else if (IS_CLOSURE(constant)) {
+      tag = CONSTANT_CLOSURE;
+      writeBytes(out, &tag, 1);
+      writeFunction(out, AS_CLOSURE(constant)->function);
+    } else {
+      tag = CONSTANT_FUNCTION;
+      writeBytes(out, &tag, 1);
+      writeFunction(out, AS_FUNCTION(constant));
+    }
+  }
+}
+
+// A damaged cache may give a size of 0, and with it a NULL buffer
+static bool readBytes(Reader* reader, void* bytes, size_t size) {
+  if (!reader->ok || (size_t) (reader->end - reader->cursor) < size) {
+    reader->ok = false;
+    return false;
+  }
+  if (size == 0) return true;
+  memcpy(bytes, reader->cursor, size);
+  reader->cursor += size;
+  return true;
+}
+
+static int32_t readInt(Reader* reader) {
+  int32_t value = 0;
+  readBytes(reader, &value, sizeof(value));
+  return value;
+}
+
+// Returns NULL both for a missing name and on error; check reader->ok
+static ObjString* readString(Reader* reader) {
+  int32_t length = readInt(reader);
+  if (!reader->ok || length < 0) return NULL;
+  if (reader->end - reader->cursor < length) {
+    reader->ok = false;
+    return NULL;
+  }
+
+  ObjString* string = copyString((const char*) reader->cursor, length);
+  reader->cursor += length;
+  return string;
+}
+
+// The slots compiled into the code must be the ones these names get
+// in this VM, which holds as long as nothing else was defined first.
+// Names the VM hasn't seen are only given their slots once define is
+// set, after the rest of the file was read, so that a rejected cache
+// leaves the globals as they were
+static bool readGlobals(Reader* reader, bool define) {
+  VM* vm = get_VM();
+  int32_t count = readInt(reader);
+  reader->globalCount = count;
+  for (int32_t i = 0; i < count && reader->ok; i++) {
+    ObjString* name = readString(reader);
+    Value slot;
+    if (name == NULL) {
+      reader->ok = false;
+    } else if (tableGet(&vm->globalSlots, name, &slot)) {
+      if (AS_NUMBER(slot) != i) reader->ok = false;
+    } else if (i < vm->globalNames.size) {
+      reader->ok = false;
+    } else if (define) {
+      globalSlot(name);
+    }
+  }
+  return reader->ok;
+}
+
+// The function is kept on the stack while it is filled in, since
+// every string and nested function read may trigger a collection.
+// Its code is checked before it is returned, as a damaged or planted
+// cache would otherwise be run as is.
+static ObjFunction* readFunction(Reader* reader) {
+  ObjFunction* function = newFunction();
+  push(OBJ_VAL(function));
+
+  function->arity = readInt(reader);
+  function->upvalueCount = readInt(reader);
+  function->registerCount = readInt(reader);
+  function->name = readString(reader);
+  if (function->name != NULL)
+    WRITE_BARRIER(&function->obj, OBJ_VAL(function->name));
+
+  // Sizes are checked against what is left before anything is
+  // allocated for them
+  Chunk* chunk = &function->chunk;
+  int32_t codeSize = readInt(reader);
+  if (codeSize < 0 || codeSize > reader->end - reader->cursor)
+    reader->ok = false;
+  if (reader->ok) {
+    reserve_ByteArray(&chunk->code, codeSize);
+    if (readBytes(reader, chunk->code.data, codeSize))
+      chunk->code.size = codeSize;
+  }
+
+  int32_t lineCount = readInt(reader);
+  if (lineCount < 0 ||
+      lineCount > (reader->end - reader->cursor) / (int) sizeof(LineStart))
+    reader->ok = false;
+  if (reader->ok) {
+    reserve_LineArray(&chunk->lines, lineCount);
+    if (readBytes(reader, chunk->lines.data, lineCount * sizeof(LineStart)))
+      chunk->lines.size = lineCount;
+  }
+
+  int32_t constantCount = readInt(reader);
+  for (int32_t i = 0; i < constantCount && reader->ok; i++) {
+    Value constant;
+    if (!readConstant(reader, &constant)) break;
+    push_back_ValueArray(&chunk->constants, constant);
+    WRITE_BARRIER(&function->obj, constant);
+  }
+
+  pop();
+  if (reader->ok && !verifyFunction(function, reader->globalCount, false))
+    reader->ok = false;
+  return reader->ok ? function : NULL;
+}
+
+static bool readConstant(Reader* reader, Value* value) {
+  uint8_t tag = 0;
+  readBytes(reader, &tag, 1);
+  if (!reader->ok) return false;
+
+  switch (tag) {
+    case CONSTANT_NUMBER: {
+      double number;
+      if (readBytes(reader, &number, sizeof(number)))
+        *value = NUMBER_VAL(number);
+      break;
+    }
+    case CONSTANT_STRING: {
+      ObjString* string = readString(reader);
+      if (string == NULL) reader->ok = false;
+      else *value = OBJ_VAL(string);
+      break;
+    }
+    case CONSTANT_FUNCTION: {
+      ObjFunction* function = readFunction(reader);
+      if (function != NULL) *value = OBJ_VAL(function);
+      break;
+    }
+    case CONSTANT_CLOSURE: {
+      ObjFunction* function = readFunction(reader);
+      if (function == NULL) break;
+      // A shared closure has no upvalues to read
+      if (readsUpvalues(function)) {
+        reader->ok = false;
+        break;
+      }
+      push(OBJ_VAL(function));
+      *value = OBJ_VAL(newClosure(function));
+      pop();
+      break;
+    }
+    default:
+      reader->ok = false;
+  }
+  return reader->ok;
+}
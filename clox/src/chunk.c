@@ -4,17 +4,17 @@
 #include "vector.h"
 
 VECTOR_IMPL(ByteArray, uint8_t)
-VECTOR_IMPL(IntArray, int)
+VECTOR_IMPL(LineArray, LineStart)
 
 void init_Chunk(Chunk* chunk) {
   init_ByteArray(&chunk->code);
-  init_IntArray(&chunk->lines);
+  init_LineArray(&chunk->lines);
   init_ValueArray(&chunk->constants);
 }
 
 void free_Chunk(Chunk* chunk) {
   free_ByteArray(&chunk->code);
-  free_IntArray(&chunk->lines);
+  free_LineArray(&chunk->lines);
   free_ValueArray(&chunk->constants);
 }
 
@@ -25,5 +25,32 @@ int addConstant(Chunk* chunk, Value value) {
 
 void writeChunk(Chunk* chunk, uint8_t byte, int line) {
   push_back_ByteArray(&chunk->code, byte);
-  push_back_IntArray(&chunk->lines, line);
+
+  LineArray* lines = &chunk->lines;
+  if (lines->size > 0 && lines->data[lines->size - 1].line == line)
+    return;
+  LineStart start = { chunk->code.size - 1, line };
+  push_back_LineArray(lines, start);
+}
+
+// Drops the last byte written, and its run if that byte started one
+void removeLastByte(Chunk* chunk) {
+  chunk->code.size--;
+  LineArray* lines = &chunk->lines;
+  if (lines->data[lines->size - 1].offset == chunk->code.size)
+    lines->size--;
+}
+
+// Binary search for the last run starting at or before offset
+int getLine(Chunk* chunk, int offset) {
+  LineStart* starts = chunk->lines.data;
+  int low = 0, high = chunk->lines.size - 1;
+  while (low < high) {
+    int mid = (low + high + 1) / 2;
+    if (starts[mid].offset > offset)
+      high = mid - 1;
+    else
+      low = mid;
+  }
+  return starts[low].line;
 }
@@ -1,47 +1,22 @@
 #include <stdio.h>
 #include <assert.h>
+#include <math.h>
 #include "compiler.h"
 #include "common.h"
 #include "scanner.h"
+#include "parser.h"
 #include "object.h"
-
-#ifdef DEBUG_PRINT_CODE
+#include "memory.h"
 #include "debug.h"
-#endif
+#include "vm.h"
 
 // Local typedefs
-typedef enum {
-  PREC_NONE,
-  PREC_ASSIGNMENT,  // =
-  PREC_OR,          // or
-  PREC_AND,         // and
-  PREC_EQUALITY,    // == !=
-  PREC_COMPARISON,  // < > <= >=
-  PREC_TERM,        // + -
-  PREC_FACTOR,      // * /
-  PREC_UNARY,       // ! -
-  PREC_CALL,        // . ()
-  PREC_PRIMARY,
-} Precedence;
-
-typedef struct {
-  Token current;
-  Token previous;
-  bool hadError;
-  bool panicMode;
-} Parser;
-
-typedef void (*ParseFn)(bool);
-
-typedef struct {
-  ParseFn prefix;
-  ParseFn infix;
-  Precedence precedence;
-} ParseRule;
-
 typedef struct {
   Token name;
   int depth;
+  int captures;         // Inner functions that close over it
+  bool escapes;         // Used other than as a direct callee
+  int closure;          // Offset of its OP_CLOSURE if a function, or -1
 } Local;
 
 typedef struct {
@@ -63,44 +38,66 @@ typedef struct Compiler {
   int localCount;
   Upvalue upvalues[UINT8_COUNT];
   int scopeDepth;
+  // Offset of the last instruction, or -1 when the current offset is
+  // a jump target and so must not be fused with what precedes it
+  int lastOp;
+  // Constant table size before the last instruction was emitted
+  int lastOpConstants;
+
+  // Open-addressed index of the constant table, so a value used many
+  // times takes one slot. Entries are constant numbers or -1; entries
+  // past the end of the table are left behind by folding and skipped.
+  int* constantIndex;
+  int constantIndexCapacity;
+  int constantIndexCount;
 } Compiler;
 
 
 // Global variables
-static Parser parser;
 static Compiler* current = NULL;
 static Chunk* compilingChunk;
+// The script being compiled, and a heap copy of it once a function
+// body has been deferred
+static const char* sourceStart;
+static ObjString* lazySource;
 
 
 // Parser utilities
-static void initCompiler(Compiler* compiler, FunctionType type);
+static void initCompiler(Compiler* compiler, FunctionType type,
+    ObjFunction* function);
 static ObjFunction* endCompiler(void);
+static void disassembleFunction(ObjFunction* function);
 static void parsePrecedence(Precedence precedence);
-static ParseRule* getRule(TokenType);
-static void advance(void);
-static void consume(TokenType type, const char* message);
-static bool match(TokenType);
-static bool check(TokenType);
-static uint8_t parseVariable(const char* errorMessage);
+static uint16_t parseVariable(const char* errorMessage);
 static void beginScope(void);
 static void endScope(void);
-static bool identifiersEqual(Token* a, Token* b);
-
-// Error handling
-static void errorAtCurrent(const char* message);
-static void error(const char* message);
-static void errorAt(Token* token, const char* message);
-static void synchronize(void);
 
 // Code generation
 static void emitByte(uint8_t byte);
+static void emitOp(uint8_t op);
+static bool lastOpIs(uint8_t op);
+static int label(void);
+static void emitPop(void);
+static int emitConditionJump(void);
+static bool fuseImmediate(uint8_t op);
+static bool lastConstant(Value* value);
+static void emitValue(Value value);
+static void removeConstants(int offset, int constants);
+static bool foldBinary(TokenType operatorType, Value a, Value b,
+    Value* result);
 static Chunk* currentChunk(void);
 static void emitReturn(void);
 static void emitBytes(uint8_t, uint8_t);
 static void emitConstant(Value value);
-static uint8_t makeConstant(Value value);
-static uint8_t identifierConstant(Token* name);
-static void defineVariable(uint8_t global);
+static int makeConstant(Value value);
+static void emitConstantOp(uint8_t op, uint8_t longOp, int constant);
+static bool sameConstant(Value a, Value b);
+static uint32_t hashConstant(Value value);
+static int* findConstant(Compiler* compiler, Value value);
+static void growConstantIndex(Compiler* compiler);
+static uint16_t identifierSlot(Token* name);
+static void emitShortOp(uint8_t instruction, uint16_t operand);
+static void defineVariable(uint16_t global);
 static int emitJump(uint8_t instruction);
 static void patchJump(int offset);
 static void emitLoop(int loopStart);
@@ -112,21 +109,26 @@ static int resolveLocal(Compiler* compiler, Token* name);
 static void markInitialized(void);
 static int resolveUpvalue(Compiler* compiler, Token* name);
 static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal);
+static void shareLocalFunction(Local* local);
+static bool readsOuterFrame(ObjFunction* function, uint8_t* upvalues);
+static int instructionLength(Chunk* chunk, int offset);
 
 // Expressions
 static void expression(void);
-static void number(bool);
-static void string(bool);
-static void literal(bool);
-static void grouping(bool);
-static void unary(bool);
-static void binary(bool);
-static void variable(bool canAssign);
+static void number(void* e, bool);
+static void string(void* e, bool);
+static void literal(void* e, bool);
+static void grouping(void* e, bool);
+static void unary(void* e, bool);
+static void binary(void* e, bool);
+static void variable(void* e, bool canAssign);
 static void function(FunctionType type);
+static void functionBody(void);
+static void deferFunction(void);
 static void namedVariable(Token name, bool canAssign);
-static void and_(bool canAssign);
-static void or_(bool canAssign);
-static void call(bool canAssign);
+static void and_(void* e, bool canAssign);
+static void or_(void* e, bool canAssign);
+static void call(void* e, bool canAssign);
 static uint8_t argumentList(void);
 
 // Statements
@@ -144,46 +146,46 @@ static void returnStatement(void);
 
 // Parse table
 static ParseRule rules[] = {
-  [TOKEN_LEFT_PAREN]      = {grouping, call,     PREC_CALL},   
-  [TOKEN_RIGHT_PAREN]     = {NULL,     NULL,     PREC_NONE},    
-  [TOKEN_LEFT_BRACE]      = {NULL,     NULL,     PREC_NONE},   
-  [TOKEN_RIGHT_BRACE]     = {NULL,     NULL,     PREC_NONE},    
-  [TOKEN_COMMA]           = {NULL,     NULL,     PREC_NONE},
-  [TOKEN_DOT]             = {NULL,     NULL,     PREC_NONE},
-  [TOKEN_MINUS]           = {unary,    binary,   PREC_TERM},
-  [TOKEN_PLUS]            = {NULL,     binary,   PREC_TERM},
-  [TOKEN_SEMICOLON]       = {NULL,     NULL,     PREC_NONE},  
-  [TOKEN_SLASH]           = {NULL,     binary,   PREC_FACTOR},
-  [TOKEN_STAR]            = {NULL,     binary,   PREC_FACTOR},
-  [TOKEN_BANG]            = {unary,    NULL,     PREC_NONE},
-  [TOKEN_BANG_EQUAL]      = {NULL,     binary,   PREC_EQUALITY},  
-  [TOKEN_EQUAL]           = {NULL,     NULL,     PREC_NONE},
-  [TOKEN_EQUAL_EQUAL]     = {NULL,     binary,   PREC_EQUALITY},  
-  [TOKEN_GREATER]         = {NULL,     binary,   PREC_COMPARISON},
-  [TOKEN_GREATER_EQUAL]   = {NULL,     binary,   PREC_COMPARISON},
-  [TOKEN_LESS]            = {NULL,     binary,   PREC_COMPARISON},
-  [TOKEN_LESS_EQUAL]      = {NULL,     binary,   PREC_COMPARISON},
-  [TOKEN_IDENTIFIER]      = {variable, NULL,     PREC_NONE},   
-  [TOKEN_STRING]          = {string,   NULL,     PREC_NONE},
-  [TOKEN_NUMBER]          = {number,   NULL,     PREC_NONE},
-  [TOKEN_AND]             = {NULL,     and_,     PREC_AND},
-  [TOKEN_CLASS]           = {NULL,     NULL,     PREC_NONE},
-  [TOKEN_ELSE]            = {NULL,     NULL,     PREC_NONE},
-  [TOKEN_FALSE]           = {literal,  NULL,     PREC_NONE},
-  [TOKEN_FOR]             = {NULL,     NULL,     PREC_NONE},
-  [TOKEN_FUN]             = {NULL,     NULL,     PREC_NONE},
-  [TOKEN_IF]              = {NULL,     NULL,     PREC_NONE},
-  [TOKEN_NIL]             = {literal,  NULL,     PREC_NONE},
-  [TOKEN_OR]              = {NULL,     or_,      PREC_OR},
-  [TOKEN_PRINT]           = {NULL,     NULL,     PREC_NONE},
-  [TOKEN_RETURN]          = {NULL,     NULL,     PREC_NONE},
-  [TOKEN_SUPER]           = {NULL,     NULL,     PREC_NONE},
-  [TOKEN_THIS]            = {NULL,     NULL,     PREC_NONE},
-  [TOKEN_TRUE]            = {literal,  NULL,     PREC_NONE},
-  [TOKEN_VAR]             = {NULL,     NULL,     PREC_NONE},
-  [TOKEN_WHILE]           = {NULL,     NULL,     PREC_NONE},
-  [TOKEN_ERROR]           = {NULL,     NULL,     PREC_NONE},
-  [TOKEN_EOF]             = {NULL,     NULL,     PREC_NONE},
+  [TOKEN_LEFT_PAREN]      = {grouping, call},
+  [TOKEN_RIGHT_PAREN]     = {NULL,     NULL},
+  [TOKEN_LEFT_BRACE]      = {NULL,     NULL},
+  [TOKEN_RIGHT_BRACE]     = {NULL,     NULL},
+  [TOKEN_COMMA]           = {NULL,     NULL},
+  [TOKEN_DOT]             = {NULL,     NULL},
+  [TOKEN_MINUS]           = {unary,    binary},
+  [TOKEN_PLUS]            = {NULL,     binary},
+  [TOKEN_SEMICOLON]       = {NULL,     NULL},
+  [TOKEN_SLASH]           = {NULL,     binary},
+  [TOKEN_STAR]            = {NULL,     binary},
+  [TOKEN_BANG]            = {unary,    NULL},
+  [TOKEN_BANG_EQUAL]      = {NULL,     binary},
+  [TOKEN_EQUAL]           = {NULL,     NULL},
+  [TOKEN_EQUAL_EQUAL]     = {NULL,     binary},
+  [TOKEN_GREATER]         = {NULL,     binary},
+  [TOKEN_GREATER_EQUAL]   = {NULL,     binary},
+  [TOKEN_LESS]            = {NULL,     binary},
+  [TOKEN_LESS_EQUAL]      = {NULL,     binary},
+  [TOKEN_IDENTIFIER]      = {variable, NULL},
+  [TOKEN_STRING]          = {string,   NULL},
+  [TOKEN_NUMBER]          = {number,   NULL},
+  [TOKEN_AND]             = {NULL,     and_},
+  [TOKEN_CLASS]           = {NULL,     NULL},
+  [TOKEN_ELSE]            = {NULL,     NULL},
+  [TOKEN_FALSE]           = {literal,  NULL},
+  [TOKEN_FOR]             = {NULL,     NULL},
+  [TOKEN_FUN]             = {NULL,     NULL},
+  [TOKEN_IF]              = {NULL,     NULL},
+  [TOKEN_NIL]             = {literal,  NULL},
+  [TOKEN_OR]              = {NULL,     or_},
+  [TOKEN_PRINT]           = {NULL,     NULL},
+  [TOKEN_RETURN]          = {NULL,     NULL},
+  [TOKEN_SUPER]           = {NULL,     NULL},
+  [TOKEN_THIS]            = {NULL,     NULL},
+  [TOKEN_TRUE]            = {literal,  NULL},
+  [TOKEN_VAR]             = {NULL,     NULL},
+  [TOKEN_WHILE]           = {NULL,     NULL},
+  [TOKEN_ERROR]           = {NULL,     NULL},
+  [TOKEN_EOF]             = {NULL,     NULL},
 };
 
 ///////////////////////////////////////
@@ -192,89 +194,245 @@ static ParseRule rules[] = {
 
 ObjFunction* compile(const char* source) {
   initScanner(source);
+  sourceStart = source;
+  lazySource = NULL;
   Compiler compiler;
-  initCompiler(&compiler, TYPE_SCRIPT);
+  initCompiler(&compiler, TYPE_SCRIPT, NULL);
 
-  parser.hadError = false;
-  parser.panicMode = false;
-
-  advance();
+  startParser();
 
   while (!match(TOKEN_EOF))
     declaration();
 
   ObjFunction* function = endCompiler();
-  return parser.hadError ? NULL : function;
+  lazySource = NULL;
+  if (parser.hadError) return NULL;
+
+  // Printed once everything is compiled, since code is still
+  // rewritten when the scope of a local function ends
+  if (get_VM()->printCode) disassembleFunction(function);
+  return function;
 }
 
-static void advance(void) {
-  parser.previous = parser.current;
+// Compiles the body into the function itself, so the closures already
+// made from it pick the code up. Only top-level functions are deferred,
+// so anything the body doesn't declare is a global.
+bool compileFunction(ObjFunction* function) {
+  // lazySource stays set until the end, which keeps the source alive
+  // while it is scanned
+  initScannerAt(function->lazySource->chars + function->lazyStart,
+      function->lazyLine);
+  Compiler compiler;
+  initCompiler(&compiler, TYPE_FUNCTION, function);
+  function->arity = 0;
+
+  startParser();
+  functionBody();
+  endCompiler();
+
+  if (parser.hadError) {
+    // Left deferred, so every call reports the error
+    free_Chunk(&function->chunk);
+    init_Chunk(&function->chunk);
+    return false;
+  }
 
-  for (;;) {
-    parser.current = scanToken();
-    if (parser.current.type != TOKEN_ERROR) break;
+  function->lazySource = NULL;
+  if (get_VM()->printCode) disassembleFunction(function);
+  return true;
+}
 
-    errorAtCurrent(parser.current.start);
+// Prints the functions a function creates, then the function itself
+static void disassembleFunction(ObjFunction* function) {
+  // Printed when it is compiled instead
+  if (function->lazySource != NULL) return;
+
+  ValueArray* constants = &function->chunk.constants;
+  for (int i = 0; i < constants->size; i++) {
+    Value constant = constants->data[i];
+    if (IS_FUNCTION(constant))
+      disassembleFunction(AS_FUNCTION(constant));
+    else if (IS_CLOSURE(constant))
+      disassembleFunction(AS_CLOSURE(constant)->function);
   }
+
+  disassembleChunk(&function->chunk, function->name != NULL
+      ? function->name->chars : "<script>");
 }
 
-static void errorAtCurrent(const char* message) {
-  errorAt(&parser.current, message);
+void markCompilerRoots(void) {
+  for (Compiler* compiler = current; compiler != NULL;
+      compiler = compiler->enclosing)
+    markObject((Obj*) compiler->function);
+  markObject((Obj*) lazySource);
 }
 
-static void error(const char* message) {
-  errorAt(&parser.previous, message);
+static void emitByte(uint8_t byte) {
+  writeChunk(currentChunk(), byte, parser.previous.line);
 }
 
-static void errorAt(Token* token, const char* message) {
-  if (parser.panicMode) return;
+static void emitOp(uint8_t op) {
+  current->lastOpConstants = currentChunk()->constants.size;
+  current->lastOp = currentChunk()->code.size;
+  emitByte(op);
+}
 
-  fprintf(stderr, "[line %d] Error", token->line);
+static bool lastOpIs(uint8_t op) {
+  return current->lastOp != -1 &&
+    currentChunk()->code.data[current->lastOp] == op;
+}
 
-  if (token->type == TOKEN_EOF)
-    fprintf(stderr, " at end");
-  else if (token->type == TOKEN_ERROR)
-    ; // Nothing
+// Marks the current offset as a jump target
+static int label(void) {
+  current->lastOp = -1;
+  return currentChunk()->code.size;
+}
+
+static void emitPop(void) {
+  if (lastOpIs(OP_SET_LOCAL))
+    currentChunk()->code.data[current->lastOp] = OP_SET_LOCAL_POP;
   else
-    fprintf(stderr, " at '%.*s'", token->length, token->start);
+    emitOp(OP_POP);
+}
 
-  fprintf(stderr, ": %s\n", message);
-  parser.hadError = true;
+// Jumps if the value on top of the stack is falsey, popping it on
+// both paths. A preceding OP_LESS is folded into the jump.
+static int emitConditionJump(void) {
+  if (lastOpIs(OP_LESS)) {
+    removeLastByte(currentChunk());
+    return emitJump(OP_JUMP_IF_NOT_LESS);
+  }
+  // The jump offset goes after the OP_LESS_INT operand
+  if (lastOpIs(OP_LESS_INT)) {
+    currentChunk()->code.data[current->lastOp] = OP_JUMP_IF_NOT_LESS_INT;
+    emitByte(0xff);
+    emitByte(0xff);
+    return currentChunk()->code.size - 2;
+  }
+  return emitJump(OP_POP_JUMP_IF_FALSE);
 }
 
-static void consume(TokenType type, const char* message) {
-  if (parser.current.type == type) {
-    advance();
-    return;
+// Turns a trailing OP_INT into op, which takes the same operand
+static bool fuseImmediate(uint8_t op) {
+  if (!lastOpIs(OP_INT)) return false;
+  currentChunk()->code.data[current->lastOp] = op;
+  return true;
+}
+
+// Whether the last instruction just pushes a compile-time constant.
+// An operand whose last instruction does is exactly that instruction.
+static bool lastConstant(Value* value) {
+  if (current->lastOp == -1) return false;
+
+  Chunk* chunk = currentChunk();
+  switch (chunk->code.data[current->lastOp]) {
+    case OP_CONSTANT:
+      *value = chunk->constants.data[chunk->code.data[current->lastOp + 1]];
+      return true;
+    case OP_CONSTANT_LONG: {
+      uint8_t* operand = &chunk->code.data[current->lastOp + 1];
+      *value = chunk->constants.data[(operand[0] << 8) | operand[1]];
+      return true;
+    }
+    case OP_INT: {
+      uint8_t* operand = &chunk->code.data[current->lastOp + 1];
+      *value = NUMBER_VAL((int16_t) ((operand[0] << 8) | operand[1]));
+      return true;
+    }
+    case OP_NIL:   *value = NIL_VAL;          return true;
+    case OP_TRUE:  *value = BOOL_VAL(true);   return true;
+    case OP_FALSE: *value = BOOL_VAL(false);  return true;
+    default:       return false;
   }
+}
+
+static void emitValue(Value value) {
+  if (IS_NIL(value))
+    emitOp(OP_NIL);
+  else if (IS_BOOL(value))
+    emitOp(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  else
+    emitConstant(value);
+}
 
-  errorAtCurrent(message);
+// Removes the constant-pushing instructions from offset to the end
+// of the chunk, along with the constants they added to the table
+static void removeConstants(int offset, int constants) {
+  Chunk* chunk = currentChunk();
+  chunk->constants.size = constants;
+  while (chunk->code.size > offset) removeLastByte(chunk);
 }
 
-static void emitByte(uint8_t byte) {
-  writeChunk(currentChunk(), byte, parser.previous.line);
+// Evaluates a binary operator on two constants the way the VM would.
+// Operand types the VM rejects are left for it to report at runtime.
+static bool foldBinary(TokenType operatorType, Value a, Value b,
+    Value* result) {
+  switch (operatorType) {
+    case TOKEN_EQUAL_EQUAL:
+      *result = BOOL_VAL(valuesEqual(a, b));
+      return true;
+    case TOKEN_BANG_EQUAL:
+      *result = BOOL_VAL(!valuesEqual(a, b));
+      return true;
+    case TOKEN_PLUS:
+      if (IS_STRING(a) && IS_STRING(b)) {
+        *result = OBJ_VAL(concatStrings(AS_STRING(a), AS_STRING(b)));
+        return true;
+      }
+      break;
+    default:
+      break;
+  }
+
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+  double x = AS_NUMBER(a), y = AS_NUMBER(b);
+  switch (operatorType) {
+    case TOKEN_PLUS:          *result = NUMBER_VAL(x + y);    break;
+    case TOKEN_MINUS:         *result = NUMBER_VAL(x - y);    break;
+    case TOKEN_STAR:          *result = NUMBER_VAL(x * y);    break;
+    case TOKEN_SLASH:         *result = NUMBER_VAL(x / y);    break;
+    case TOKEN_GREATER:       *result = BOOL_VAL(x > y);      break;
+    case TOKEN_LESS:          *result = BOOL_VAL(x < y);      break;
+    case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y));   break;
+    case TOKEN_LESS_EQUAL:    *result = BOOL_VAL(!(x > y));   break;
+    default: return false;
+  }
+  return true;
 }
 
 static Chunk* currentChunk(void) {
   return &current->function->chunk;
 }
 
-static void initCompiler(Compiler* compiler, FunctionType type) {
+// Compiles into `function` if given, otherwise into a new function
+// named after the previous token
+static void initCompiler(Compiler* compiler, FunctionType type,
+    ObjFunction* function) {
   compiler->enclosing = current;
   compiler->function = NULL;
   compiler->type = type;
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
-  compiler->function = newFunction();
+  compiler->lastOp = -1;
+  compiler->lastOpConstants = 0;
+  compiler->constantIndex = NULL;
+  compiler->constantIndexCapacity = 0;
+  compiler->constantIndexCount = 0;
+  compiler->function = function != NULL ? function : newFunction();
   current = compiler;
 
-  if (type != TYPE_SCRIPT) {
+  if (type != TYPE_SCRIPT && function == NULL) {
     current->function->name = copyString(parser.previous.start,
         parser.previous.length);
+    WRITE_BARRIER(&current->function->obj,
+        OBJ_VAL(current->function->name));
   }
 
   Local* local = &current->locals[current->localCount++];
   local->depth = 0;
+  local->captures = 0;
+  local->escapes = false;
+  local->closure = -1;
   local->name.start = "";
   local->name.length = 0;
 }
@@ -283,130 +441,249 @@ static ObjFunction* endCompiler(void) {
   emitReturn();
   ObjFunction* function = current->function;
 
-#ifdef DEBUG_PRINT_CODE
-  if (!parser.hadError)
-    disassembleChunk(currentChunk(), function->name != NULL
-        ? function->name->chars : "<script>");
-#endif
+  // The function's own scope is never ended by endScope()
+  for (int i = current->localCount - 1; i > 0; i--)
+    shareLocalFunction(&current->locals[i]);
 
+  free(current->constantIndex);
   current = current->enclosing;
   return function;
 }
 
 static void emitReturn(void) {
-  emitByte(OP_NIL);
-  emitByte(OP_RETURN);
+  emitOp(OP_NIL);
+  emitOp(OP_RETURN);
 }
 
 static void emitBytes(uint8_t b1, uint8_t b2) {
-  emitByte(b1);
+  emitOp(b1);
   emitByte(b2);
 }
 
 static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+  // Small integers are pushed as an immediate; -0 is not one
+  if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    if (number >= INT16_MIN && number <= INT16_MAX &&
+        number == (int16_t) number &&
+        !(number == 0 && signbit(number))) {
+      emitShortOp(OP_INT, (uint16_t) (int16_t) number);
+      return;
+    }
+  }
+
+  int constants = currentChunk()->constants.size;
+  emitConstantOp(OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(value));
+  // The instruction owns the constant it may have added
+  current->lastOpConstants = constants;
 }
 
-static uint8_t makeConstant(Value value) {
+// Returns the index of value in the constant table, adding it if it
+// is not there yet
+static int makeConstant(Value value) {
+  int* entry = findConstant(current, value);
+  if (*entry != -1) return *entry;
+
   int constant = addConstant(currentChunk(), value);
-  if (constant > UINT8_MAX) {
-    error("Too many constants in one chunk");
+  WRITE_BARRIER(&current->function->obj, value);
+  if (constant > UINT16_MAX) {
+    errorAtPrevious("Too many constants in one chunk");
     return 0;
   }
 
-  return (uint8_t) constant;
+  *entry = constant;
+  current->constantIndexCount++;
+  if (current->constantIndexCount * 4 >= current->constantIndexCapacity * 3)
+    growConstantIndex(current);
+  return constant;
 }
 
-static void parsePrecedence(Precedence precedence) {
-  advance();
-  ParseFn prefixRule = getRule(parser.previous.type)->prefix;
-  if (!prefixRule) {
-    error("Expect expression");
-    return;
+// Constants past 255 take the long form with a 16-bit operand
+static void emitConstantOp(uint8_t op, uint8_t longOp, int constant) {
+  if (constant <= UINT8_MAX)
+    emitBytes(op, (uint8_t) constant);
+  else
+    emitShortOp(longOp, (uint16_t) constant);
+}
+
+// Numbers are compared bit for bit so that 0 and -0 stay distinct;
+// strings are interned, so everything else compares by identity
+static bool sameConstant(Value a, Value b) {
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    double x = AS_NUMBER(a), y = AS_NUMBER(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
   }
-  
-  bool canAssign = precedence <= PREC_ASSIGNMENT;
-  prefixRule(canAssign);
+  return valuesEqual(a, b);
+}
 
-  while (precedence <= getRule(parser.current.type)->precedence) {
-    advance();
-    ParseFn infixRule = getRule(parser.previous.type)->infix;
-    infixRule(canAssign);
+static uint32_t hashConstant(Value value) {
+  uint64_t bits = 0;
+  if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    memcpy(&bits, &number, sizeof(double));
+  } else if (IS_OBJ(value)) {
+    bits = (uint64_t) (uintptr_t) AS_OBJ(value);
   }
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdULL;
+  bits ^= bits >> 33;
+  return (uint32_t) bits;
+}
 
-  if (canAssign && match(TOKEN_EQUAL)) {
-    error("Invalid assignment target");
+// Returns the index entry holding value, or the empty one where it
+// would go
+static int* findConstant(Compiler* compiler, Value value) {
+  if (compiler->constantIndexCapacity == 0) growConstantIndex(compiler);
+
+  ValueArray* constants = &compiler->function->chunk.constants;
+  uint32_t mask = (uint32_t) compiler->constantIndexCapacity - 1;
+  for (uint32_t i = hashConstant(value) & mask; ; i = (i + 1) & mask) {
+    int* entry = &compiler->constantIndex[i];
+    if (*entry == -1) return entry;
+    if (*entry < constants->size &&
+        sameConstant(constants->data[*entry], value))
+      return entry;
   }
 }
 
-static ParseRule* getRule(TokenType type) {
-  return &rules[type];
+// Rehashes into a table twice the size, dropping stale entries
+static void growConstantIndex(Compiler* compiler) {
+  int* old = compiler->constantIndex;
+  int oldCapacity = compiler->constantIndexCapacity;
+
+  compiler->constantIndexCapacity = MAX(16, oldCapacity * 2);
+  compiler->constantIndex =
+    malloc(compiler->constantIndexCapacity * sizeof(int));
+  memset(compiler->constantIndex, 0xff,
+      compiler->constantIndexCapacity * sizeof(int));
+  compiler->constantIndexCount = 0;
+
+  ValueArray* constants = &compiler->function->chunk.constants;
+  for (int i = 0; i < oldCapacity; ++i) {
+    if (old[i] == -1 || old[i] >= constants->size) continue;
+    *findConstant(compiler, constants->data[old[i]]) = old[i];
+    compiler->constantIndexCount++;
+  }
+  free(old);
+}
+
+static void parsePrecedence(Precedence precedence) {
+  parseExpression(rules, precedence, NULL);
 }
 
 static void expression(void) {
   parsePrecedence(PREC_ASSIGNMENT);
 }
 
-static void number(bool x) {
+static void number(void* e, bool x) {
   (void)x;
   double value = strtod(parser.previous.start, NULL);
   emitConstant(NUMBER_VAL(value));
 }
 
-static void string(bool x) {
+static void string(void* e, bool x) {
   (void)x;
   emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,
           parser.previous.length - 2)));
 }
 
-static void literal(bool x) {
+static void literal(void* e, bool x) {
   (void)x;
   switch (parser.previous.type) {
-    case TOKEN_FALSE: emitByte(OP_FALSE); break;
-    case TOKEN_NIL: emitByte(OP_NIL); break;
-    case TOKEN_TRUE: emitByte(OP_TRUE); break;
+    case TOKEN_FALSE: emitOp(OP_FALSE); break;
+    case TOKEN_NIL: emitOp(OP_NIL); break;
+    case TOKEN_TRUE: emitOp(OP_TRUE); break;
     default: assert(false); // unreachable
   }
 }
 
-static void grouping(bool x) {
+static void grouping(void* e, bool x) {
   (void)x;
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression");
 }
 
-static void unary(bool x) {
+static void unary(void* e, bool x) {
   (void)x;
   TokenType operatorType = parser.previous.type;
 
   // Compile the operand
   parsePrecedence(PREC_UNARY);
 
+  // Fold constant operands; negating a non-number stays a runtime
+  // error
+  Value operand;
+  int operandStart = current->lastOp;
+  int operandConstants = current->lastOpConstants;
+  if (lastConstant(&operand)) {
+    if (operatorType == TOKEN_BANG) {
+      removeConstants(operandStart, operandConstants);
+      emitValue(BOOL_VAL(isFalsey(operand)));
+      return;
+    }
+    if (operatorType == TOKEN_MINUS && IS_NUMBER(operand)) {
+      removeConstants(operandStart, operandConstants);
+      emitValue(NUMBER_VAL(-AS_NUMBER(operand)));
+      return;
+    }
+  }
+
   // Emit the operator instruction
   switch (operatorType) {
-    case TOKEN_BANG: emitByte(OP_NOT); break;
-    case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+    case TOKEN_BANG: emitOp(OP_NOT); break;
+    case TOKEN_MINUS: emitOp(OP_NEGATE); break;
     default: assert(false); // unreachable
   }
 }
 
-static void binary(bool x) {
+static void binary(void* e, bool x) {
   (void)x;
   TokenType operatorType = parser.previous.type;
-  ParseRule* rule = getRule(operatorType);
-  parsePrecedence((Precedence) (rule->precedence + 1));
+
+  Value left, right, result;
+  int leftStart = current->lastOp;
+  int leftConstants = current->lastOpConstants;
+  int rightStart = currentChunk()->code.size;
+  bool leftConstant = lastConstant(&left);
+
+  parsePrecedence((Precedence) (infixPrecedence(operatorType) + 1));
+
+  // Both operands are constants: do the operation now. The operands
+  // stay in the constant table, and so reachable, until the result
+  // has been computed.
+  if (leftConstant && current->lastOp == rightStart &&
+      lastConstant(&right) &&
+      foldBinary(operatorType, left, right, &result)) {
+    removeConstants(leftStart, leftConstants);
+    emitValue(result);
+    return;
+  }
 
   switch (operatorType) {
-    case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT);  break;
-    case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL);           break;
-    case TOKEN_GREATER:       emitByte(OP_GREATER);         break;
-    case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT);   break;
-    case TOKEN_LESS:          emitByte(OP_LESS);            break;
-    case TOKEN_LESS_EQUAL:    emitBytes(OP_GREATER, OP_NOT);break;
-    case TOKEN_PLUS:          emitByte(OP_ADD);             break;
-    case TOKEN_MINUS:         emitByte(OP_SUBTRACT);        break;
-    case TOKEN_STAR:          emitByte(OP_MULTIPLY);        break;
-    case TOKEN_SLASH:         emitByte(OP_DIVIDE);          break;
+    case TOKEN_BANG_EQUAL:    emitOp(OP_NOT_EQUAL);         break;
+    case TOKEN_EQUAL_EQUAL:
+      if (!fuseImmediate(OP_EQUAL_INT)) emitOp(OP_EQUAL);
+      break;
+    case TOKEN_GREATER:
+      if (!fuseImmediate(OP_GREATER_INT)) emitOp(OP_GREATER);
+      break;
+    case TOKEN_GREATER_EQUAL: emitOp(OP_GREATER_EQUAL);     break;
+    case TOKEN_LESS:
+      if (!fuseImmediate(OP_LESS_INT)) emitOp(OP_LESS);
+      break;
+    case TOKEN_LESS_EQUAL:    emitOp(OP_LESS_EQUAL);        break;
+    case TOKEN_PLUS:
+      // The right operand was a lone constant: add it in place
+      if (lastOpIs(OP_CONSTANT))
+        currentChunk()->code.data[current->lastOp] = OP_ADD_CONSTANT;
+      else if (!fuseImmediate(OP_ADD_INT))
+        emitOp(OP_ADD);
+      break;
+    case TOKEN_MINUS:
+      if (!fuseImmediate(OP_SUBTRACT_INT)) emitOp(OP_SUBTRACT);
+      break;
+    case TOKEN_STAR:          emitOp(OP_MULTIPLY);          break;
+    case TOKEN_SLASH:         emitOp(OP_DIVIDE);            break;
     default: assert(false); // Unreachable
   }
 }
@@ -443,112 +720,103 @@ static void statement(void) {
   }
 }
 
-static bool match(TokenType type) {
-  if (!check(type)) return false;
-  advance();
-  return true;
-}
-
-static bool check(TokenType type) {
-  return parser.current.type == type;
-}
-
 static void printStatement(void) {
   expression();
   consume(TOKEN_SEMICOLON, "Expect ';' after value");
-  emitByte(OP_PRINT);
+  emitOp(OP_PRINT);
 }
 
 static void expressionStatement(void) {
   expression();
   consume(TOKEN_SEMICOLON, "Expect ';' after expression");
-  emitByte(OP_POP);
-}
-
-static void synchronize(void) {
-  parser.panicMode = false;
-
-  while (parser.current.type != TOKEN_EOF) {
-    if (parser.previous.type == TOKEN_SEMICOLON) return;
-    switch (parser.current.type) {
-      case TOKEN_CLASS:
-      case TOKEN_FUN: 
-      case TOKEN_VAR:
-      case TOKEN_FOR:
-      case TOKEN_IF:
-      case TOKEN_WHILE:
-      case TOKEN_PRINT:
-      case TOKEN_RETURN:
-        return;
-
-      default: ;
-    }
-    advance();
-  }
+  emitPop();
 }
 
 static void varDeclaration(void) {
-  uint8_t global = parseVariable("Expect variable name");
+  uint16_t global = parseVariable("Expect variable name");
 
   if (match(TOKEN_EQUAL)) {
     expression();
   } else {
-    emitByte(OP_NIL);
+    emitOp(OP_NIL);
   }
   consume(TOKEN_SEMICOLON, 
       "Expect ';' after variable declaration");
   defineVariable(global);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
+static uint16_t parseVariable(const char* errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
 
   declareVariable();
   if (current->scopeDepth > 0) return 0;
 
-  return identifierConstant(&parser.previous);
+  return identifierSlot(&parser.previous);
+}
+
+// Globals are addressed by a VM-wide slot number rather than by name
+static uint16_t identifierSlot(Token* name) {
+  int slot = globalSlot(copyString(name->start, name->length));
+  if (slot > UINT16_MAX) {
+    errorAtPrevious("Too many global variables");
+    return 0;
+  }
+
+  return (uint16_t) slot;
 }
 
-static uint8_t identifierConstant(Token* name) {
-  return makeConstant(OBJ_VAL(
-        copyString(name->start, name->length)));
+static void emitShortOp(uint8_t instruction, uint16_t operand) {
+  emitOp(instruction);
+  emitByte((operand >> 8) & 0xff);
+  emitByte(operand & 0xff);
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(uint16_t global) {
   if (current->scopeDepth > 0) {
     markInitialized();
     return;
   }
 
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitShortOp(OP_DEFINE_GLOBAL, global);
 }
 
-static void variable(bool canAssign) {
+static void variable(void* e, bool canAssign) {
   namedVariable(parser.previous, canAssign);
 }
 
 static void namedVariable(Token name, bool canAssign) {
   uint8_t getOp, setOp;
   int arg = resolveLocal(current, &name);
+  bool global = false;
 
   if (arg != -1) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
+    if (!check(TOKEN_LEFT_PAREN)) current->locals[arg].escapes = true;
   } else if ((arg = resolveUpvalue(current, &name)) != -1) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
-    arg = identifierConstant(&name);
+    arg = identifierSlot(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
+    global = true;
   }
 
-
+  uint8_t op = getOp;
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(setOp, (uint8_t) arg);
+    op = setOp;
+  }
+
+  // Global slots take a 16-bit operand
+  if (global) {
+    emitShortOp(op, (uint16_t) arg);
+  } else if (op == OP_GET_LOCAL && lastOpIs(OP_GET_LOCAL)) {
+    currentChunk()->code.data[current->lastOp] = OP_GET_LOCAL_2;
+    emitByte((uint8_t) arg);
   } else {
-    emitBytes(getOp, (uint8_t) arg);
+    emitBytes(op, (uint8_t) arg);
   }
 }
 
@@ -569,7 +837,13 @@ static void endScope(void) {
   while (current->localCount > 0 &&
       current->locals[current->localCount - 1].depth
       > current->scopeDepth) {
-    emitByte(OP_POP);
+    Local* local = &current->locals[current->localCount - 1];
+    shareLocalFunction(local);
+    // Captured variables move off the stack into their upvalue
+    if (local->captures > 0)
+      emitOp(OP_CLOSE_UPVALUE);
+    else
+      emitPop();
     current->localCount--;
   }
 }
@@ -585,7 +859,7 @@ static void declareVariable(void) {
       break;
 
     if (identifiersEqual(name, &local->name))
-      error("Already a variable with this name in this scope");
+      errorAtPrevious("Already a variable with this name in this scope");
   }
 
   addLocal(*name);
@@ -593,18 +867,16 @@ static void declareVariable(void) {
 
 static void addLocal(Token name) {
   if (current->localCount == UINT8_COUNT) {
-    error("Too many local variables in function");
+    errorAtPrevious("Too many local variables in function");
     return;
   }
 
   Local* local = &current->locals[current->localCount++];
   local->name = name;
   local->depth = -1;
-}
-
-static bool identifiersEqual(Token* a, Token* b) {
-  if (a->length != b->length) return false;
-  return memcmp(a->start, b->start, a->length) == 0;
+  local->captures = 0;
+  local->escapes = false;
+  local->closure = -1;
 }
 
 static int resolveLocal(Compiler* compiler, Token* name) {
@@ -612,7 +884,7 @@ static int resolveLocal(Compiler* compiler, Token* name) {
     Local* local = &compiler->locals[i];
     if (identifiersEqual(name, &local->name)) {
       if (local->depth == -1) {
-        error("Can't read local variable in its own initializer");
+        errorAtPrevious("Can't read local variable in its own initializer");
       }
       return i;
     }
@@ -632,21 +904,19 @@ static void ifStatement(void) {
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition");
 
-  int thenJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
+  int thenJump = emitConditionJump();
   statement();
 
   int elseJump = emitJump(OP_JUMP);
 
   patchJump(thenJump);
-  emitByte(OP_POP);
 
   if (match(TOKEN_ELSE)) statement();
   patchJump(elseJump);
 }
 
 static int emitJump(uint8_t instruction) {
-  emitByte(instruction);
+  emitOp(instruction);
   emitByte(0xff);
   emitByte(0xff);
   return currentChunk()->code.size - 2;
@@ -654,53 +924,52 @@ static int emitJump(uint8_t instruction) {
 
 static void patchJump(int offset) {
   // -2 to adjust for the bytecode for the jump offset itself
-  int jump = currentChunk()->code.size - 2;
+  int jump = currentChunk()->code.size - offset - 2;
   if (jump > UINT16_MAX)
-    error("Too much code to jump over");
+    errorAtPrevious("Too much code to jump over");
 
   currentChunk()->code.data[offset] = (jump >> 8) & 0xff;
   currentChunk()->code.data[offset+1] = jump & 0xff;
+  label();
 }
 
 
-static void and_(bool canAssign) {
+static void and_(void* e, bool canAssign) {
   int endJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
+  emitPop();
   parsePrecedence(PREC_AND);
   patchJump(endJump);
 }
 
-static void or_(bool canAssign) {
+static void or_(void* e, bool canAssign) {
   int elseJump = emitJump(OP_JUMP_IF_FALSE);
   int endJump = emitJump(OP_JUMP);
 
   patchJump(elseJump);
-  emitByte(OP_POP);
+  emitPop();
 
   parsePrecedence(PREC_OR);
   patchJump(endJump);
 }
 
 static void whileStatement(void) {
-  int loopStart = currentChunk()->code.size;
+  int loopStart = label();
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'");
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition");
 
-  int exitJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
+  int exitJump = emitConditionJump();
   statement();
   emitLoop(loopStart);
 
   patchJump(exitJump);
-  emitByte(OP_POP);
 }
 
 static void emitLoop(int loopStart) {
-  emitByte(OP_LOOP);
+  emitOp(OP_LOOP);
 
   int offset = currentChunk()->code.size - loopStart + 2;
-  if (offset > UINT16_MAX) error("Loop body too large");
+  if (offset > UINT16_MAX) errorAtPrevious("Loop body too large");
 
   emitByte((offset >> 8) & 0xff);
   emitByte(offset & 0xff);
@@ -717,19 +986,18 @@ static void forStatement(void) {
     expressionStatement();
   }
 
-  int loopStart = currentChunk()->code.size;
+  int loopStart = label();
   int exitJump = -1;
   if (!match(TOKEN_SEMICOLON)) {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after loop condition");
-    exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    exitJump = emitConditionJump();
   }
   if (!match(TOKEN_RIGHT_PAREN)) {
     int bodyJump = emitJump(OP_JUMP);
-    int incrementStart = currentChunk()->code.size;
+    int incrementStart = label();
     expression();
-    emitByte(OP_POP);
+    emitPop();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses");
 
     emitLoop(loopStart);
@@ -740,24 +1008,40 @@ static void forStatement(void) {
   statement();
   emitLoop(loopStart);
 
-  if (exitJump != -1) {
-    patchJump(exitJump);
-    emitByte(OP_POP);
-  }
+  if (exitJump != -1) patchJump(exitJump);
 
   endScope();
 }
 
 static void funDeclaration(void) {
-  uint8_t global = parseVariable("Expect function name.");
+  uint16_t global = parseVariable("Expect function name.");
   markInitialized();
-  function(TYPE_FUNCTION);
+  if (get_VM()->lazyFunctions && current->type == TYPE_SCRIPT &&
+      current->scopeDepth == 0)
+    deferFunction();
+  else
+    function(TYPE_FUNCTION);
+  if (current->scopeDepth > 0)
+    current->locals[current->localCount - 1].closure = current->lastOp;
   defineVariable(global);
 }
 
 static void function(FunctionType type) {
   Compiler compiler;
-  initCompiler(&compiler, type);
+  initCompiler(&compiler, type, NULL);
+  functionBody();
+
+  ObjFunction* function = endCompiler();
+  emitConstantOp(OP_CLOSURE, OP_CLOSURE_LONG,
+      makeConstant(OBJ_VAL(function)));
+  for (int i = 0; i < function->upvalueCount; i++) {
+    emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
+    emitByte(compiler.upvalues[i].index);
+  }
+}
+
+// The parameter list and body, into the current function
+static void functionBody(void) {
   beginScope();
 
   consume(TOKEN_LEFT_PAREN, "Expect '(' after function name");
@@ -767,19 +1051,59 @@ static void function(FunctionType type) {
       if (current->function->arity > 255) {
         errorAtCurrent("Can't have more than 255 parameters");
       }
-      uint8_t constant = parseVariable("Expect parameter name");
+      uint16_t constant = parseVariable("Expect parameter name");
       defineVariable(constant);
     } while (match(TOKEN_COMMA));
   }
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters");
   consume(TOKEN_LEFT_BRACE, "Expect '{' before function body");
   block();
+}
 
-  ObjFunction* function = endCompiler();
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+// Records where the function's parameters and body are instead of
+// compiling them; the first call compiles them. The body is only
+// scanned for its closing brace, so errors inside it are reported on
+// that first call.
+static void deferFunction(void) {
+  if (lazySource == NULL)
+    lazySource = copyString(sourceStart, (int) strlen(sourceStart));
+
+  // Held by the constant table from the start
+  ObjFunction* function = newFunction();
+  int constant = makeConstant(OBJ_VAL(function));
+  function->name = copyString(parser.previous.start,
+      parser.previous.length);
+  WRITE_BARRIER(&function->obj, OBJ_VAL(function->name));
+  function->lazySource = lazySource;
+  WRITE_BARRIER(&function->obj, OBJ_VAL(lazySource));
+  function->lazyStart = (int) (parser.current.start - sourceStart);
+  function->lazyLine = parser.current.line;
+
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after function name");
+  if (!check(TOKEN_RIGHT_PAREN)) {
+    do {
+      function->arity++;
+      if (function->arity > 255) {
+        errorAtCurrent("Can't have more than 255 parameters");
+      }
+      consume(TOKEN_IDENTIFIER, "Expect parameter name");
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters");
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before function body");
+
+  int depth = 1;
+  while (depth > 0 && !check(TOKEN_EOF)) {
+    if (check(TOKEN_LEFT_BRACE)) depth++;
+    else if (check(TOKEN_RIGHT_BRACE)) depth--;
+    advanceToken();
+  }
+  if (depth > 0) errorAtCurrent("Expect '}' after block");
+
+  emitConstantOp(OP_CLOSURE, OP_CLOSURE_LONG, constant);
 }
 
-static void call(bool canAssign) {
+static void call(void* e, bool canAssign) {
   uint8_t argCount = argumentList();
   emitBytes(OP_CALL, argCount);
 }
@@ -790,7 +1114,7 @@ static uint8_t argumentList(void) {
     do {
       expression();
       if (argCount == 255) 
-        error("Can't have more than 255 arguments");
+        errorAtPrevious("Can't have more than 255 arguments");
       argCount++;
     } while (match(TOKEN_COMMA));
   }
@@ -800,7 +1124,7 @@ static uint8_t argumentList(void) {
 
 static void returnStatement(void) {
   if (current->type == TYPE_SCRIPT) {
-    error("Can't return from top-level code");
+    errorAtPrevious("Can't return from top-level code");
   }
 
   if (match(TOKEN_SEMICOLON)) {
@@ -808,7 +1132,7 @@ static void returnStatement(void) {
   } else {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value");
-    emitByte(OP_RETURN);
+    emitOp(OP_RETURN);
   }
 }
 
@@ -820,6 +1144,12 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
     return addUpvalue(compiler, (uint8_t) local, true);
   }
 
+  // A variable further out is reached through the enclosing
+  // function's own upvalue
+  int upvalue = resolveUpvalue(compiler->enclosing, name);
+  if (upvalue != -1)
+    return addUpvalue(compiler, (uint8_t) upvalue, false);
+
   return -1;
 }
 
@@ -834,11 +1164,130 @@ static int addUpvalue(Compiler* compiler, uint8_t index,
   }
 
   if (upvalueCount == UINT8_COUNT) {
-    error("Too many closure variables in function");
+    errorAtPrevious("Too many closure variables in function");
     return 0;
   }
 
   compiler->upvalues[upvalueCount].isLocal = isLocal;
   compiler->upvalues[upvalueCount].index = index;
+  if (isLocal) {
+    Local* local = &compiler->enclosing->locals[index];
+    local->captures++;
+    // A local function called from inside another function may run
+    // in that function's frame, so it can't read its caller's slots.
+    // This must hold even if the capturer is shared and the capture
+    // is dropped again
+    if (local->closure != -1) local->escapes = true;
+  }
   return compiler->function->upvalueCount++;
 }
+
+// A local function that is only ever called directly, by name, from
+// the function that declares it can't outlive that function's frame,
+// and every call to it is made from that frame. Its captured variables
+// can then be read from the caller's stack slots with OP_GET_OUTER
+// instead of through upvalues, and with no upvalues to hold one
+// closure can be created here and shared by every execution of the
+// declaration.
+static void shareLocalFunction(Local* local) {
+  if (local->closure == -1 || local->escapes || local->captures > 0 ||
+      parser.hadError)
+    return;
+
+  Chunk* chunk = currentChunk();
+  uint8_t* code = &chunk->code.data[local->closure];
+  if (code[0] != OP_CLOSURE) return;
+
+  Value constant = chunk->constants.data[code[1]];
+  ObjFunction* function = AS_FUNCTION(constant);
+  uint8_t* upvalues = code + 2;
+  if (!readsOuterFrame(function, upvalues)) return;
+
+  // The captured variables no longer need upvalues either
+  for (int i = 0; i < function->upvalueCount; i++)
+    current->locals[upvalues[2 * i + 1]].captures--;
+
+  ObjClosure* closure = newClosure(function);
+  chunk->constants.data[code[1]] = OBJ_VAL(closure);
+  WRITE_BARRIER(&current->function->obj, OBJ_VAL(closure));
+  code[0] = function->upvalueCount == 0 ? OP_CONSTANT : OP_SHARED_CLOSURE;
+}
+
+// Rewrites the function's upvalue accesses to read the caller's
+// slots directly. Fails, changing nothing, if any upvalue is not a
+// local of the caller or is itself captured by a nested function.
+static bool readsOuterFrame(ObjFunction* function, uint8_t* upvalues) {
+  for (int i = 0; i < function->upvalueCount; i++)
+    if (!upvalues[2 * i]) return false;
+
+  Chunk* chunk = &function->chunk;
+  for (int offset = 0; offset < chunk->code.size;
+      offset += instructionLength(chunk, offset)) {
+    uint8_t* code = &chunk->code.data[offset];
+    if (code[0] != OP_CLOSURE && code[0] != OP_CLOSURE_LONG) continue;
+
+    int pairs = code[0] == OP_CLOSURE ? 2 : 3;
+    int constant = code[0] == OP_CLOSURE ? code[1] : (code[1] << 8) | code[2];
+    ObjFunction* inner = AS_FUNCTION(chunk->constants.data[constant]);
+    for (int j = 0; j < inner->upvalueCount; j++)
+      if (!code[pairs + 2 * j]) return false;
+  }
+
+  for (int offset = 0; offset < chunk->code.size;
+      offset += instructionLength(chunk, offset)) {
+    uint8_t* code = &chunk->code.data[offset];
+    if (code[0] == OP_GET_UPVALUE || code[0] == OP_SET_UPVALUE) {
+      code[0] = code[0] == OP_GET_UPVALUE ? OP_GET_OUTER : OP_SET_OUTER;
+      code[1] = upvalues[2 * code[1] + 1];
+    }
+  }
+  return true;
+}
+
+static int instructionLength(Chunk* chunk, int offset) {
+  uint8_t* code = &chunk->code.data[offset];
+  switch (code[0]) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_OUTER:
+    case OP_SET_OUTER:
+    case OP_CALL:
+    case OP_SET_LOCAL_POP:
+    case OP_ADD_CONSTANT:
+      return 2;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_CONSTANT_LONG:
+    case OP_GET_LOCAL_2:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_INT:
+    case OP_ADD_INT:
+    case OP_SUBTRACT_INT:
+    case OP_EQUAL_INT:
+    case OP_LESS_INT:
+    case OP_GREATER_INT:
+      return 3;
+    case OP_JUMP_IF_NOT_LESS_INT:
+      return 5;
+    case OP_CLOSURE:
+    case OP_SHARED_CLOSURE:
+    case OP_CLOSURE_LONG: {
+      int length = code[0] == OP_CLOSURE_LONG ? 3 : 2;
+      int constant = length == 2 ? code[1] : (code[1] << 8) | code[2];
+      Value value = chunk->constants.data[constant];
+      ObjFunction* function = IS_CLOSURE(value)
+        ? AS_CLOSURE(value)->function : AS_FUNCTION(value);
+      return length + 2 * function->upvalueCount;
+    }
+    default:
+      return 1;
+  }
+}
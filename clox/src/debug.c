@@ -2,6 +2,7 @@
 
 #include "debug.h"
 #include "value.h"
+#include "vm.h"
 
 static const char* op_names[OP_LAST];
 
@@ -33,10 +34,74 @@ static void init_op_names(void) {
   ADD_OP_NAME(OP_LOOP);
   ADD_OP_NAME(OP_CALL);
   ADD_OP_NAME(OP_CLOSURE);
+  ADD_OP_NAME(OP_GET_UPVALUE);
+  ADD_OP_NAME(OP_SET_UPVALUE);
+  ADD_OP_NAME(OP_CLOSE_UPVALUE);
+  ADD_OP_NAME(OP_SHARED_CLOSURE);
+  ADD_OP_NAME(OP_GET_OUTER);
+  ADD_OP_NAME(OP_SET_OUTER);
+  ADD_OP_NAME(OP_CONSTANT_LONG);
+  ADD_OP_NAME(OP_CLOSURE_LONG);
+  ADD_OP_NAME(OP_GET_LOCAL_2);
+  ADD_OP_NAME(OP_SET_LOCAL_POP);
+  ADD_OP_NAME(OP_ADD_CONSTANT);
+  ADD_OP_NAME(OP_NOT_EQUAL);
+  ADD_OP_NAME(OP_LESS_EQUAL);
+  ADD_OP_NAME(OP_GREATER_EQUAL);
+  ADD_OP_NAME(OP_POP_JUMP_IF_FALSE);
+  ADD_OP_NAME(OP_JUMP_IF_NOT_LESS);
+  ADD_OP_NAME(OP_INT);
+  ADD_OP_NAME(OP_ADD_INT);
+  ADD_OP_NAME(OP_SUBTRACT_INT);
+  ADD_OP_NAME(OP_EQUAL_INT);
+  ADD_OP_NAME(OP_LESS_INT);
+  ADD_OP_NAME(OP_GREATER_INT);
+  ADD_OP_NAME(OP_JUMP_IF_NOT_LESS_INT);
+  ADD_OP_NAME(OP_REG_MOVE);
+  ADD_OP_NAME(OP_REG_LOAD_CONSTANT);
+  ADD_OP_NAME(OP_REG_LOAD_NIL);
+  ADD_OP_NAME(OP_REG_LOAD_TRUE);
+  ADD_OP_NAME(OP_REG_LOAD_FALSE);
+  ADD_OP_NAME(OP_REG_DEFINE_GLOBAL);
+  ADD_OP_NAME(OP_REG_GET_GLOBAL);
+  ADD_OP_NAME(OP_REG_SET_GLOBAL);
+  ADD_OP_NAME(OP_REG_ADD);
+  ADD_OP_NAME(OP_REG_SUBTRACT);
+  ADD_OP_NAME(OP_REG_MULTIPLY);
+  ADD_OP_NAME(OP_REG_DIVIDE);
+  ADD_OP_NAME(OP_REG_EQUAL);
+  ADD_OP_NAME(OP_REG_NOT_EQUAL);
+  ADD_OP_NAME(OP_REG_LESS);
+  ADD_OP_NAME(OP_REG_LESS_EQUAL);
+  ADD_OP_NAME(OP_REG_GREATER);
+  ADD_OP_NAME(OP_REG_GREATER_EQUAL);
+  ADD_OP_NAME(OP_REG_ADD_CONST);
+  ADD_OP_NAME(OP_REG_SUBTRACT_CONST);
+  ADD_OP_NAME(OP_REG_MULTIPLY_CONST);
+  ADD_OP_NAME(OP_REG_DIVIDE_CONST);
+  ADD_OP_NAME(OP_REG_EQUAL_CONST);
+  ADD_OP_NAME(OP_REG_NOT_EQUAL_CONST);
+  ADD_OP_NAME(OP_REG_LESS_CONST);
+  ADD_OP_NAME(OP_REG_LESS_EQUAL_CONST);
+  ADD_OP_NAME(OP_REG_GREATER_CONST);
+  ADD_OP_NAME(OP_REG_GREATER_EQUAL_CONST);
+  ADD_OP_NAME(OP_REG_NOT);
+  ADD_OP_NAME(OP_REG_NEGATE);
+  ADD_OP_NAME(OP_REG_JUMP);
+  ADD_OP_NAME(OP_REG_JUMP_IF_FALSE);
+  ADD_OP_NAME(OP_REG_JUMP_IF_TRUE);
+  ADD_OP_NAME(OP_REG_PRINT);
+  ADD_OP_NAME(OP_REG_CALL);
+  ADD_OP_NAME(OP_REG_RETURN);
+  ADD_OP_NAME(OP_REG_CLOSURE);
+}
+
+const char* opName(uint8_t op) {
+  if (op_names[OP_CONSTANT] == NULL) init_op_names();
+  return op < OP_LAST && op_names[op] != NULL ? op_names[op] : "?";
 }
 
 void disassembleChunk(Chunk* chunk, const char* name) {
-  init_op_names();
   printf("== %s ==\n", name);
 
   for (int offset = 0; offset < chunk->code.size; )
@@ -57,6 +122,16 @@ static int constantInstruction(const char* name, Chunk* chunk,
   return offset + 2;
 }
 
+static int constantLongInstruction(const char* name, Chunk* chunk,
+    int offset) {
+  uint16_t constant = (uint16_t) (chunk->code.data[offset + 1] << 8);
+  constant |= chunk->code.data[offset + 2];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.data[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
 static int byteInstruction(const char* name, Chunk* chunk,
     int offset) {
   uint8_t slot = chunk->code.data[offset + 1];
@@ -64,6 +139,23 @@ static int byteInstruction(const char* name, Chunk* chunk,
   return offset + 2;
 }
 
+static int twoByteInstruction(const char* name, Chunk* chunk,
+    int offset) {
+  printf("%-16s %4d %4d\n", name, chunk->code.data[offset + 1],
+      chunk->code.data[offset + 2]);
+  return offset + 3;
+}
+
+static int globalInstruction(const char* name, Chunk* chunk,
+    int offset) {
+  uint16_t slot = (uint16_t) (chunk->code.data[offset + 1] << 8);
+  slot |= chunk->code.data[offset + 2];
+  printf("%-16s %4d '", name, slot);
+  printValue(get_VM()->globalNames.data[slot]);
+  printf("'\n");
+  return offset + 3;
+}
+
 static int jumpInstruction(const char* name, int sign,
     Chunk* chunk, int offset) {
   uint16_t jump = (uint16_t) (chunk->code.data[offset+1] << 8);
@@ -73,36 +165,131 @@ static int jumpInstruction(const char* name, int sign,
   return offset + 3;
 }
 
+static int intInstruction(const char* name, Chunk* chunk,
+    int offset) {
+  int16_t value = (int16_t) ((chunk->code.data[offset + 1] << 8) |
+      chunk->code.data[offset + 2]);
+  printf("%-16s %4d\n", name, value);
+  return offset + 3;
+}
+
+static int intJumpInstruction(const char* name, Chunk* chunk,
+    int offset) {
+  uint8_t* code = chunk->code.data + offset;
+  int16_t value = (int16_t) ((code[1] << 8) | code[2]);
+  uint16_t jump = (uint16_t) ((code[3] << 8) | code[4]);
+  printf("%-16s %4d %4d -> %d\n", name, value, offset,
+      offset + 5 + jump);
+  return offset + 5;
+}
+
+// Register instructions: print the operands that the opcode uses,
+// plus the constant or global they refer to
+static int registerInstruction(Chunk* chunk, int offset) {
+  uint8_t* code = chunk->code.data + offset;
+  uint8_t instruction = code[0];
+  int a = code[1], b = code[2], c = code[3];
+  int bx = (b << 8) | c;
+  printf("%-26s ", opName(instruction));
+
+  switch (instruction) {
+    case OP_REG_LOAD_NIL:
+    case OP_REG_LOAD_TRUE:
+    case OP_REG_LOAD_FALSE:
+    case OP_REG_PRINT:
+    case OP_REG_RETURN:
+      printf("r%d\n", a);
+      break;
+    case OP_REG_MOVE:
+    case OP_REG_NOT:
+    case OP_REG_NEGATE:
+      printf("r%d r%d\n", a, b);
+      break;
+    case OP_REG_CALL:
+      printf("r%d %d\n", a, b);
+      break;
+    case OP_REG_LOAD_CONSTANT:
+    case OP_REG_CLOSURE:
+      printf("r%d k%d '", a, bx);
+      printValue(chunk->constants.data[bx]);
+      printf("'\n");
+      break;
+    case OP_REG_DEFINE_GLOBAL:
+    case OP_REG_GET_GLOBAL:
+    case OP_REG_SET_GLOBAL:
+      printf("r%d g%d '", a, bx);
+      printValue(get_VM()->globalNames.data[bx]);
+      printf("'\n");
+      break;
+    case OP_REG_JUMP:
+    case OP_REG_JUMP_IF_FALSE:
+    case OP_REG_JUMP_IF_TRUE:
+      printf("r%d -> %d\n", a, offset + 4 + (int16_t) bx);
+      break;
+    default:
+      if (instruction >= OP_REG_ADD_CONST) {
+        printf("r%d r%d k%d '", a, b, c);
+        printValue(chunk->constants.data[c]);
+        printf("'\n");
+      } else {
+        printf("r%d r%d r%d\n", a, b, c);
+      }
+      break;
+  }
+  return offset + 4;
+}
+
 int disassembleInstruction(Chunk* chunk, int offset) {
   printf("%04d ", offset);
 
-  if (offset > 0 &&
-      chunk->lines.data[offset] == chunk->lines.data[offset - 1]) {
+  int line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", chunk->lines.data[offset]);
+    printf("%4d ", line);
   }
 
   uint8_t instruction = chunk->code.data[offset];
+  if (instruction >= OP_REG_MOVE && instruction < OP_LAST)
+    return registerInstruction(chunk, offset);
+
   switch (instruction) {
     // Instructions with operands
     case OP_CONSTANT:
+    case OP_ADD_CONSTANT:
+      return constantInstruction(opName(instruction), 
+          chunk, offset);
+    case OP_CONSTANT_LONG:
+      return constantLongInstruction(opName(instruction),
+          chunk, offset);
     case OP_DEFINE_GLOBAL:
     case OP_GET_GLOBAL:
     case OP_SET_GLOBAL:
-      return constantInstruction(op_names[instruction], 
+      return globalInstruction(opName(instruction),
           chunk, offset);
     case OP_GET_LOCAL:
     case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
     case OP_CALL:
-      return byteInstruction(op_names[instruction], 
+      return byteInstruction(opName(instruction), 
           chunk, offset);
     case OP_JUMP:
     case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_LESS:
     case OP_LOOP:
-      return jumpInstruction(op_names[instruction],
+      return jumpInstruction(opName(instruction),
           instruction == OP_LOOP ? -1 : +1,
           chunk, offset);
+    case OP_INT:
+    case OP_ADD_INT:
+    case OP_SUBTRACT_INT:
+    case OP_EQUAL_INT:
+    case OP_LESS_INT:
+    case OP_GREATER_INT:
+      return intInstruction(opName(instruction), chunk, offset);
+    case OP_JUMP_IF_NOT_LESS_INT:
+      return intJumpInstruction(opName(instruction), chunk, offset);
     // Single byte instructions
     case OP_RETURN:
     case OP_NEGATE:
@@ -117,15 +304,42 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_EQUAL:
     case OP_GREATER:
     case OP_LESS:
+    case OP_NOT_EQUAL:
+    case OP_LESS_EQUAL:
+    case OP_GREATER_EQUAL:
     case OP_PRINT:
     case OP_POP:
-      return simpleInstruction(op_names[instruction], offset);
-    case OP_CLOSURE: {
+      return simpleInstruction(opName(instruction), offset);
+    case OP_GET_LOCAL_2:
+      return twoByteInstruction(opName(instruction), chunk, offset);
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_OUTER:
+    case OP_SET_OUTER:
+      return byteInstruction(opName(instruction), chunk, offset);
+    case OP_CLOSE_UPVALUE:
+      return simpleInstruction(opName(instruction), offset);
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+    case OP_SHARED_CLOSURE: {
+      int constant = chunk->code.data[++offset];
+      if (instruction == OP_CLOSURE_LONG)
+        constant = (constant << 8) | chunk->code.data[++offset];
       offset++;
-      uint8_t constant = chunk->code.data[offset++];
-      printf("%-16s %4d ", "OP_CLOSURE", constant);
+      printf("%-16s %4d ", opName(instruction), constant);
       printValue(chunk->constants.data[constant]);
       printf("\n");
+
+      Value value = chunk->constants.data[constant];
+      ObjFunction* function = IS_CLOSURE(value)
+        ? AS_CLOSURE(value)->function : AS_FUNCTION(value);
+      for (int i = 0; i < function->upvalueCount; i++) {
+        int isLocal = chunk->code.data[offset];
+        int index = chunk->code.data[offset + 1];
+        printf("%04d    |                     %s %d\n",
+            offset, isLocal ? "local" : "upvalue", index);
+        offset += 2;
+      }
       return offset;
     }
     default:
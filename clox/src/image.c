@@ -0,0 +1,621 @@
+#define _XOPEN_SOURCE 700
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "image.h"
+#include "memory.h"
+#include "object.h"
+#include "verify.h"
+#include "vm.h"
+
+#define IMAGE_MAGIC 0x494f4c58u   // "XLOI" read as little endian
+#define IMAGE_VERSION 3
+
+// File layout, all in native byte order:
+//   ImageHeader
+//   objectCount records: a type byte, the payload size as u32 and the
+//     payload
+//   globalCount globals in slot order: the name's number and the value
+// Objects are numbered in record order. Leaves (strings, builders and
+// natives) come first, then functions, upvalues and closures, so a
+// closure's function is allocated before the closure itself.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t opcodeCount;
+  uint32_t objectCount;
+  uint32_t globalCount;
+  uint32_t registers;   // Saved from the register backend
+} ImageHeader;
+
+typedef enum {
+  IMAGE_NIL,
+  IMAGE_FALSE,
+  IMAGE_TRUE,
+  IMAGE_UNDEFINED,
+  IMAGE_NUMBER,
+  IMAGE_OBJECT,
+} ValueTag;
+
+typedef struct {
+  Obj* object;
+  int number;
+} ObjectEntry;
+
+typedef struct {
+  ObjectEntry* entries;   // Open addressing on the object's address
+  int capacity;
+  GrayStack objects;      // Every reachable object, in record order
+  ByteArray out;
+} Writer;
+
+typedef struct {
+  const uint8_t* cursor;
+  const uint8_t* end;
+  bool ok;
+} Reader;
+
+static void gatherObjects(Writer* writer);
+static void addObject(Writer* writer, Obj* object);
+static void addValue(Writer* writer, Value value);
+static ObjectEntry* findEntry(Writer* writer, Obj* object);
+static int objectRank(Obj* object);
+static void writeBytes(Writer* writer, const void* bytes, size_t size);
+static void writeInt(Writer* writer, int32_t value);
+static void writeText(Writer* writer, const char* chars, int length);
+static void writeReference(Writer* writer, Obj* object);
+static void writeValue(Writer* writer, Value value);
+static void writeObject(Writer* writer, Obj* object);
+
+static bool readBytes(Reader* reader, void* bytes, size_t size);
+static int32_t readInt(Reader* reader);
+static const char* readText(Reader* reader, int* length);
+static Obj* readReference(Reader* reader, int type);
+static Value readValue(Reader* reader);
+static Obj* allocateRecord(Reader* reader, ObjType type);
+static void fixUpRecord(Reader* reader, Obj* object);
+static void fixUpFunction(Reader* reader, ObjFunction* function);
+static bool verifyObject(Obj* object, int globalCount, bool registers);
+static bool readGlobals(Reader* reader, int count);
+
+// Objects allocated so far while loading, kept alive until the
+// globals point at them
+static Obj** loaded = NULL;
+static int loadedCount = 0;
+
+bool saveImage(const char* path, bool registers) {
+  Writer writer;
+  writer.entries = NULL;
+  writer.capacity = 0;
+  init_GrayStack(&writer.objects);
+  init_ByteArray(&writer.out);
+
+  gatherObjects(&writer);
+
+  VM* vm = get_VM();
+  ImageHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = IMAGE_MAGIC;
+  header.version = IMAGE_VERSION;
+  header.opcodeCount = OP_LAST;
+  header.registers = registers;
+  header.objectCount = writer.objects.size;
+  header.globalCount = vm->globalNames.size;
+  writeBytes(&writer, &header, sizeof(header));
+
+  for (int i = 0; i < writer.objects.size; i++)
+    writeObject(&writer, writer.objects.data[i]);
+
+  for (int i = 0; i < vm->globalNames.size; i++) {
+    writeReference(&writer, AS_OBJ(vm->globalNames.data[i]));
+    writeValue(&writer, vm->globalValues.data[i]);
+  }
+
+  FILE* file = fopen(path, "wb");
+  bool written = file != NULL &&
+    fwrite(writer.out.data, 1, writer.out.size, file) ==
+      (size_t) writer.out.size;
+  if (file != NULL && fclose(file) != 0) written = false;
+
+  free(writer.entries);
+  free_GrayStack(&writer.objects);
+  free_ByteArray(&writer.out);
+  return written;
+}
+
+bool loadImage(const char* path, bool registers) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(ImageHeader)) {
+    close(fd);
+    return false;
+  }
+
+  size_t size = (size_t) st.st_size;
+  void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return false;
+
+  Reader reader = { data, (const uint8_t*) data + size, true };
+  ImageHeader header;
+  readBytes(&reader, &header, sizeof(header));
+  if (header.magic != IMAGE_MAGIC || header.version != IMAGE_VERSION ||
+      header.opcodeCount != OP_LAST || header.registers != registers ||
+      header.objectCount > (size_t) (reader.end - reader.cursor))
+    reader.ok = false;
+
+  int count = reader.ok ? (int) header.objectCount : 0;
+  Reader* records = malloc(MAX(count, 1) * sizeof(Reader));
+  loaded = malloc(MAX(count, 1) * sizeof(Obj*));
+
+  // First allocate every object, filling in the leaves...
+  for (int i = 0; i < count && reader.ok; i++) {
+    uint8_t type = 0;
+    readBytes(&reader, &type, 1);
+    uint32_t recordSize = (uint32_t) readInt(&reader);
+    if (!reader.ok || recordSize > (size_t) (reader.end - reader.cursor)) {
+      reader.ok = false;
+      break;
+    }
+
+    records[i] = (Reader) {
+      reader.cursor, reader.cursor + recordSize, true
+    };
+    reader.cursor += recordSize;
+
+    // The fix-up pass reads the record again from the start
+    Reader record = records[i];
+    Obj* object = allocateRecord(&record, (ObjType) type);
+    if (object == NULL) reader.ok = false;
+    else loaded[loadedCount++] = object;
+  }
+
+  // ...then point the rest at each other
+  for (int i = 0; i < count && reader.ok; i++) {
+    fixUpRecord(&records[i], loaded[i]);
+    reader.ok = records[i].ok;
+  }
+
+  // Nothing runs until all the code has been checked
+  for (int i = 0; i < count && reader.ok; i++)
+    reader.ok = verifyObject(loaded[i], (int) header.globalCount,
+        registers);
+
+  if (reader.ok) readGlobals(&reader, (int) header.globalCount);
+
+  free(records);
+  free(loaded);
+  loaded = NULL;
+  loadedCount = 0;
+  munmap(data, size);
+  return reader.ok;
+}
+
+void markImageRoots(void) {
+  for (int i = 0; i < loadedCount; i++)
+    markObject(loaded[i]);
+}
+
+// Collects everything reachable from the globals. Nothing here
+// allocates on the heap, so no collection can run meanwhile.
+static void gatherObjects(Writer* writer) {
+  VM* vm = get_VM();
+  for (int i = 0; i < vm->globalNames.size; i++) {
+    addValue(writer, vm->globalNames.data[i]);
+    addValue(writer, vm->globalValues.data[i]);
+  }
+
+  for (int i = 0; i < writer->objects.size; i++) {
+    Obj* object = writer->objects.data[i];
+    switch (object->type) {
+      case OBJ_FUNCTION: {
+        ObjFunction* function = (ObjFunction*) object;
+        addObject(writer, (Obj*) function->name);
+        addObject(writer, (Obj*) function->lazySource);
+        for (int j = 0; j < function->chunk.constants.size; j++)
+          addValue(writer, function->chunk.constants.data[j]);
+        break;
+      }
+      case OBJ_CLOSURE: {
+        ObjClosure* closure = (ObjClosure*) object;
+        addObject(writer, (Obj*) closure->function);
+        for (int j = 0; j < closure->upvalueCount; j++)
+          addObject(writer, (Obj*) closure->upvalues[j]);
+        break;
+      }
+      case OBJ_UPVALUE:
+        addValue(writer, *((ObjUpvalue*) object)->location);
+        break;
+      case OBJ_BUILDER:
+      case OBJ_NATIVE:
+      case OBJ_STRING:
+        break;
+    }
+  }
+
+  // Put them in record order and number them
+  GrayStack ordered;
+  init_GrayStack(&ordered);
+  reserve_GrayStack(&ordered, MAX(writer->objects.size, 1));
+  for (int rank = 0; rank < 4; rank++) {
+    for (int i = 0; i < writer->objects.size; i++) {
+      Obj* object = writer->objects.data[i];
+      if (objectRank(object) != rank) continue;
+      findEntry(writer, object)->number = ordered.size;
+      push_back_unsafe_GrayStack(&ordered, object);
+    }
+  }
+  free_GrayStack(&writer->objects);
+  writer->objects = ordered;
+}
+
+static void addObject(Writer* writer, Obj* object) {
+  if (object == NULL) return;
+
+  // Keep the load at or below 1/2
+  if ((writer->objects.size + 1) * 2 > writer->capacity) {
+    ObjectEntry* old = writer->entries;
+    int oldCapacity = writer->capacity;
+    writer->capacity = MAX(64, oldCapacity * 2);
+    writer->entries = calloc(writer->capacity, sizeof(ObjectEntry));
+    for (int i = 0; i < oldCapacity; i++)
+      if (old[i].object != NULL)
+        *findEntry(writer, old[i].object) = old[i];
+    free(old);
+  }
+
+  ObjectEntry* entry = findEntry(writer, object);
+  if (entry->object != NULL) return;
+  entry->object = object;
+  entry->number = -1;
+  push_back_GrayStack(&writer->objects, object);
+}
+
+static void addValue(Writer* writer, Value value) {
+  if (IS_OBJ(value)) addObject(writer, AS_OBJ(value));
+}
+
+// Returns the object's entry, or the empty one it would go in
+static ObjectEntry* findEntry(Writer* writer, Obj* object) {
+  uint64_t hash = ((uintptr_t) object >> 4) * 0x9e3779b97f4a7c15u;
+  int mask = writer->capacity - 1;
+  for (int i = (int) (hash >> 32) & mask; ; i = (i + 1) & mask) {
+    ObjectEntry* entry = &writer->entries[i];
+    if (entry->object == object || entry->object == NULL) return entry;
+  }
+}
+
+static int objectRank(Obj* object) {
+  switch (object->type) {
+    case OBJ_FUNCTION: return 1;
+    case OBJ_UPVALUE:  return 2;
+    case OBJ_CLOSURE:  return 3;
+    default:           return 0;
+  }
+}
+
+// A function whose compilation was deferred has no code yet, so sizes
+// may be 0 with a NULL buffer
+static void writeBytes(Writer* writer, const void* bytes, size_t size) {
+  ByteArray* out = &writer->out;
+  if (size == 0) return;
+  if (out->size + (int) size > out->capacity)
+    reserve_ByteArray(out, MAX(out->capacity * 2, out->size + (int) size));
+  memcpy(out->data + out->size, bytes, size);
+  out->size += (int) size;
+}
+
+static void writeInt(Writer* writer, int32_t value) {
+  writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeText(Writer* writer, const char* chars, int length) {
+  writeInt(writer, length);
+  writeBytes(writer, chars, length);
+}
+
+static void writeReference(Writer* writer, Obj* object) {
+  writeInt(writer, object == NULL ? -1 : findEntry(writer, object)->number);
+}
+
+static void writeValue(Writer* writer, Value value) {
+  uint8_t tag;
+  if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    tag = IMAGE_NUMBER;
+    writeBytes(writer, &tag, 1);
+    writeBytes(writer, &number, sizeof(number));
+    return;
+  }
+
+  if (IS_OBJ(value)) tag = IMAGE_OBJECT;
+  else if (IS_UNDEFINED(value)) tag = IMAGE_UNDEFINED;
+  else if (IS_NIL(value)) tag = IMAGE_NIL;
+  else tag = AS_BOOL(value) ? IMAGE_TRUE : IMAGE_FALSE;
+  writeBytes(writer, &tag, 1);
+  if (tag == IMAGE_OBJECT) writeReference(writer, AS_OBJ(value));
+}
+
+static void writeObject(Writer* writer, Obj* object) {
+  uint8_t type = (uint8_t) object->type;
+  writeBytes(writer, &type, 1);
+  int sizeOffset = writer->out.size;
+  writeInt(writer, 0);
+
+  switch (object->type) {
+    case OBJ_STRING: {
+      ObjString* string = (ObjString*) object;
+      writeText(writer, string->chars, string->length);
+      break;
+    }
+    case OBJ_BUILDER: {
+      ObjBuilder* builder = (ObjBuilder*) object;
+      writeText(writer, builder->buffer->chars, builder->length);
+      break;
+    }
+    case OBJ_NATIVE: {
+      const char* name = nativeName(((ObjNative*) object)->function);
+      writeText(writer, name, (int) strlen(name));
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*) object;
+      writeInt(writer, function->arity);
+      writeInt(writer, function->upvalueCount);
+      writeInt(writer, function->registerCount);
+      writeReference(writer, (Obj*) function->name);
+      writeReference(writer, (Obj*) function->lazySource);
+      writeInt(writer, function->lazyStart);
+      writeInt(writer, function->lazyLine);
+
+      Chunk* chunk = &function->chunk;
+      writeInt(writer, chunk->code.size);
+      writeBytes(writer, chunk->code.data, chunk->code.size);
+      writeInt(writer, chunk->lines.size);
+      writeBytes(writer, chunk->lines.data,
+          chunk->lines.size * sizeof(LineStart));
+      writeInt(writer, chunk->constants.size);
+      for (int i = 0; i < chunk->constants.size; i++)
+        writeValue(writer, chunk->constants.data[i]);
+      break;
+    }
+    case OBJ_UPVALUE:
+      writeValue(writer, *((ObjUpvalue*) object)->location);
+      break;
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*) object;
+      writeReference(writer, (Obj*) closure->function);
+      writeInt(writer, closure->upvalueCount);
+      for (int i = 0; i < closure->upvalueCount; i++)
+        writeReference(writer, (Obj*) closure->upvalues[i]);
+      break;
+    }
+  }
+
+  int32_t size = writer->out.size - sizeOffset - (int) sizeof(int32_t);
+  memcpy(writer->out.data + sizeOffset, &size, sizeof(size));
+}
+
+static bool readBytes(Reader* reader, void* bytes, size_t size) {
+  if (!reader->ok || (size_t) (reader->end - reader->cursor) < size) {
+    reader->ok = false;
+    return false;
+  }
+  if (size == 0) return true;
+  memcpy(bytes, reader->cursor, size);
+  reader->cursor += size;
+  return true;
+}
+
+static int32_t readInt(Reader* reader) {
+  int32_t value = 0;
+  readBytes(reader, &value, sizeof(value));
+  return value;
+}
+
+// Returns the characters in place in the image
+static const char* readText(Reader* reader, int* length) {
+  *length = readInt(reader);
+  if (!reader->ok || *length < 0 || reader->end - reader->cursor < *length) {
+    reader->ok = false;
+    return NULL;
+  }
+  const char* chars = (const char*) reader->cursor;
+  reader->cursor += *length;
+  return chars;
+}
+
+// Returns NULL for no object. With `type` >= 0 the object must be one
+// of that type.
+static Obj* readReference(Reader* reader, int type) {
+  int32_t number = readInt(reader);
+  if (!reader->ok || number == -1) return NULL;
+  if (number < 0 || number >= loadedCount ||
+      (type >= 0 && loaded[number]->type != (ObjType) type)) {
+    reader->ok = false;
+    return NULL;
+  }
+  return loaded[number];
+}
+
+static Value readValue(Reader* reader) {
+  uint8_t tag = 0;
+  readBytes(reader, &tag, 1);
+  switch (tag) {
+    case IMAGE_NIL:       return NIL_VAL;
+    case IMAGE_FALSE:     return BOOL_VAL(false);
+    case IMAGE_TRUE:      return BOOL_VAL(true);
+    case IMAGE_UNDEFINED: return UNDEFINED_VAL;
+    case IMAGE_NUMBER: {
+      double number = 0;
+      readBytes(reader, &number, sizeof(number));
+      return NUMBER_VAL(number);
+    }
+    case IMAGE_OBJECT: {
+      Obj* object = readReference(reader, -1);
+      if (object == NULL) reader->ok = false;
+      return reader->ok ? OBJ_VAL(object) : NIL_VAL;
+    }
+  }
+  reader->ok = false;
+  return NIL_VAL;
+}
+
+// Strings, builders and natives are complete once allocated; the
+// other objects only get what allocation needs
+static Obj* allocateRecord(Reader* reader, ObjType type) {
+  int length;
+  switch (type) {
+    case OBJ_STRING: {
+      const char* chars = readText(reader, &length);
+      return reader->ok ? (Obj*) copyString(chars, length) : NULL;
+    }
+    case OBJ_BUILDER: {
+      const char* chars = readText(reader, &length);
+      return reader->ok ? (Obj*) newBuilder(chars, length) : NULL;
+    }
+    case OBJ_NATIVE: {
+      const char* chars = readText(reader, &length);
+      NativeFn native = reader->ok ? findNative(chars, length) : NULL;
+      return native != NULL ? (Obj*) newNative(native) : NULL;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = newFunction();
+      function->arity = readInt(reader);
+      function->upvalueCount = readInt(reader);
+      function->registerCount = readInt(reader);
+      // Closures of it are made before its code is checked
+      if (function->upvalueCount < 0 || function->upvalueCount > UINT8_COUNT)
+        reader->ok = false;
+      return reader->ok ? (Obj*) function : NULL;
+    }
+    case OBJ_UPVALUE: {
+      ObjUpvalue* upvalue = newUpvalue(NULL);
+      upvalue->location = &upvalue->closed;
+      return (Obj*) upvalue;
+    }
+    case OBJ_CLOSURE: {
+      Obj* function = readReference(reader, OBJ_FUNCTION);
+      if (function == NULL) return NULL;
+      return (Obj*) newClosure((ObjFunction*) function);
+    }
+  }
+  return NULL;
+}
+
+// Nothing allocates on the heap from here on, but earlier objects may
+// already have been promoted, hence the barriers
+static void fixUpRecord(Reader* reader, Obj* object) {
+  switch (object->type) {
+    case OBJ_FUNCTION:
+      fixUpFunction(reader, (ObjFunction*) object);
+      break;
+    case OBJ_UPVALUE: {
+      ObjUpvalue* upvalue = (ObjUpvalue*) object;
+      upvalue->closed = readValue(reader);
+      WRITE_BARRIER(object, upvalue->closed);
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*) object;
+      readReference(reader, OBJ_FUNCTION);
+      if (readInt(reader) != closure->upvalueCount) reader->ok = false;
+      // A shared closure has no upvalues of its own; its slots stay NULL
+      for (int i = 0; i < closure->upvalueCount && reader->ok; i++) {
+        Obj* upvalue = readReference(reader, OBJ_UPVALUE);
+        closure->upvalues[i] = (ObjUpvalue*) upvalue;
+        if (upvalue != NULL) WRITE_BARRIER(object, OBJ_VAL(upvalue));
+      }
+      break;
+    }
+    case OBJ_BUILDER:
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+      break;
+  }
+}
+
+static void fixUpFunction(Reader* reader, ObjFunction* function) {
+  for (int i = 0; i < 3; i++) readInt(reader);
+  function->name = (ObjString*) readReference(reader, OBJ_STRING);
+  if (function->name != NULL)
+    WRITE_BARRIER(&function->obj, OBJ_VAL(function->name));
+
+  function->lazySource = (ObjString*) readReference(reader, OBJ_STRING);
+  function->lazyStart = readInt(reader);
+  function->lazyLine = readInt(reader);
+  if (function->lazySource != NULL) {
+    WRITE_BARRIER(&function->obj, OBJ_VAL(function->lazySource));
+    if (function->lazyStart < 0 ||
+        function->lazyStart > function->lazySource->length)
+      reader->ok = false;
+  }
+
+  // Sizes are checked against what is left of the record before
+  // anything is allocated for them
+  Chunk* chunk = &function->chunk;
+  int32_t codeSize = readInt(reader);
+  if (codeSize < 0 || codeSize > reader->end - reader->cursor)
+    reader->ok = false;
+  if (reader->ok) {
+    reserve_ByteArray(&chunk->code, codeSize);
+    if (readBytes(reader, chunk->code.data, codeSize))
+      chunk->code.size = codeSize;
+  }
+
+  int32_t lineCount = readInt(reader);
+  if (lineCount < 0 ||
+      lineCount > (reader->end - reader->cursor) / (int) sizeof(LineStart))
+    reader->ok = false;
+  if (reader->ok) {
+    reserve_LineArray(&chunk->lines, lineCount);
+    if (readBytes(reader, chunk->lines.data, lineCount * sizeof(LineStart)))
+      chunk->lines.size = lineCount;
+  }
+
+  int32_t constantCount = readInt(reader);
+  for (int32_t i = 0; i < constantCount && reader->ok; i++) {
+    Value constant = readValue(reader);
+    push_back_ValueArray(&chunk->constants, constant);
+    WRITE_BARRIER(&function->obj, constant);
+  }
+}
+
+// Functions need code the interpreter can run safely, and a shared
+// closure, with no upvalues of its own, a function that doesn't use
+// them
+static bool verifyObject(Obj* object, int globalCount, bool registers) {
+  switch (object->type) {
+    case OBJ_FUNCTION:
+      return verifyFunction((ObjFunction*) object, globalCount, registers);
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*) object;
+      for (int i = 0; i < closure->upvalueCount; i++)
+        if (closure->upvalues[i] == NULL)
+          return !readsUpvalues(closure->function);
+      return true;
+    }
+    default:
+      return true;
+  }
+}
+
+// Slots are compiled into the code, so each global has to land in the
+// slot it had when the image was saved
+static bool readGlobals(Reader* reader, int count) {
+  VM* vm = get_VM();
+  for (int i = 0; i < count && reader->ok; i++) {
+    Obj* name = readReference(reader, OBJ_STRING);
+    Value value = readValue(reader);
+    if (name == NULL || globalSlot((ObjString*) name) != i) {
+      reader->ok = false;
+      break;
+    }
+    vm->globalValues.data[i] = value;
+  }
+  return reader->ok;
+}
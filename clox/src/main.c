@@ -3,11 +3,20 @@
 #include <string.h>
 
 #include "common.h"
+#include "cache.h"
 #include "chunk.h"
+#include "image.h"
+#include "compiler.h"
 #include "debug.h"
 #include "vm.h"
 #include "table.h"
 #include "object.h"
+#include "memory.h"
+#include "profile.h"
+#include "sampler.h"
+
+static InterpretResult (*interpretSource)(const char*) = interpret;
+static bool useCache = true;
 
 static void repl(void) {
   char line[1024];
@@ -18,7 +27,7 @@ static void repl(void) {
       break;
     }
 
-    interpret(line);
+    interpretSource(line);
   }
 }
 
@@ -50,27 +59,111 @@ static char* readFile(const char* path) {
   return buffer;
 }
 
+// Only the stack backend is cached, and not while disassembling since
+// that happens as the script is compiled. Deferred functions are left
+// out too, as the cache holds no source to compile them from.
+static InterpretResult runCached(const char* path, const char* source) {
+  ObjFunction* function = loadCache(path, source);
+  if (function == NULL) {
+    function = compile(source);
+    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    writeCache(path, source, function);
+  }
+  return interpretFunction(function);
+}
+
 static void runFile(const char* path) {
   char* source = readFile(path);
-  InterpretResult result = interpret(source);
+  InterpretResult result;
+  VM* vm = get_VM();
+  if (useCache && interpretSource == interpret && !vm->printCode &&
+      !vm->lazyFunctions)
+    result = runCached(path, source);
+  else
+    result = interpretSource(source);
   free(source);
 
   if (result == INTERPRET_COMPILE_ERROR) exit(65);
   if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+static void usage(void) {
+  fprintf(stderr, "Usage: clox [--registers] [--disassemble] [--trace] "
+      "[--gc-stats] [--gc-pause-us N] [--sample-profile PATH] "
+      "[--no-cache] [--lazy] [--image PATH] [--save-image PATH] "
+      "[path]\n");
+  exit(64);
+}
+
 int main(int argc, const char* argv[]) {
   initVM();
+#ifdef PROFILE_OPCODES
+  // Also reported when a script exits with an error
+  atexit(printOpcodeProfile);
+#endif
 
-  if (argc == 1) {
+  const char* path = NULL;
+  const char* imagePath = NULL;
+  const char* saveImagePath = NULL;
+  bool gcStats = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--registers") == 0) {
+      interpretSource = interpretRegisters;
+    } else if (strcmp(argv[i], "--disassemble") == 0) {
+      get_VM()->printCode = true;
+    } else if (strcmp(argv[i], "--lazy") == 0) {
+      get_VM()->lazyFunctions = true;
+    } else if (strcmp(argv[i], "--trace") == 0) {
+      get_VM()->traceExecution = true;
+    } else if (strcmp(argv[i], "--sample-profile") == 0 && i + 1 < argc) {
+      if (!startSampler(argv[++i])) {
+        fprintf(stderr, "Could not start the sampling profiler\n");
+        exit(74);
+      }
+    } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+      imagePath = argv[++i];
+    } else if (strcmp(argv[i], "--save-image") == 0 && i + 1 < argc) {
+      saveImagePath = argv[++i];
+    } else if (strcmp(argv[i], "--no-cache") == 0) {
+      useCache = false;
+    } else if (strcmp(argv[i], "--gc-stats") == 0) {
+      gcStats = true;
+    } else if (strcmp(argv[i], "--gc-pause-us") == 0 && i + 1 < argc) {
+      // Only the generational collector adapts to a pause budget
+#ifdef GC_GENERATIONAL
+      get_VM()->gcPauseBudget = strtoull(argv[++i], NULL, 10) * 1000;
+#else
+      i++;
+#endif
+    } else if (argv[i][0] == '-' || path != NULL) {
+      usage();
+    } else {
+      path = argv[i];
+    }
+  }
+
+  // Images hold compiled code, which differs between the backends
+  bool registers = interpretSource == interpretRegisters;
+  if (imagePath != NULL && !loadImage(imagePath, registers)) {
+    fprintf(stderr, "Could not load image \"%s\"\n", imagePath);
+    exit(74);
+  }
+
+  if (path == NULL) {
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+    runFile(path);
+  }
+
+  // Only reached when the script ran without errors
+  if (saveImagePath != NULL && !saveImage(saveImagePath, registers)) {
+    fprintf(stderr, "Could not write image \"%s\"\n", saveImagePath);
+    exit(74);
   }
 
+  if (gcStats) printGCStats();
+  // Names in the profile point into the heap, so write it first
+  stopSampler();
   freeVM();
   return 0;
 }
@@ -0,0 +1,409 @@
+#include <stdio.h>
+#include <time.h>
+#include "memory.h"
+#include "compiler.h"
+#include "vm.h"
+#include "sampler.h"
+#include "image.h"
+
+#ifdef DEBUG_LOG_GC
+#include "debug.h"
+#endif
+
+VECTOR_IMPL(GrayStack, Obj*)
+
+static void markRoots(void);
+static void markArray(ValueArray* array);
+static void traceReferences(void);
+static void blackenObject(Obj* object);
+static size_t sweep(Obj** list, bool promote);
+static void majorCollection(void);
+static uint64_t clockNs(void);
+static void recordPause(bool major, uint64_t ns);
+
+#ifdef GC_GENERATIONAL
+static void minorCollection(void);
+
+// During a minor collection old objects are treated as already black
+static bool minorCollecting = false;
+#endif
+
+static void trackAllocation(size_t oldSize, size_t newSize) {
+  VM* vm = get_VM();
+  vm->bytesAllocated += newSize - oldSize;
+
+  if (newSize > oldSize) {
+#ifdef GC_GENERATIONAL
+    vm->nurseryBytes += newSize - oldSize;
+#endif
+#ifdef DEBUG_STRESS_GC
+    collectGarbage();
+#elif defined(GC_GENERATIONAL)
+    if (vm->nurseryBytes > vm->nurseryLimit) collectGarbage();
+#else
+    if (vm->bytesAllocated > vm->nextGC) collectGarbage();
+#endif
+  }
+}
+
+static void* checkedRealloc(void* pointer, size_t newSize) {
+  void* result = realloc(pointer, newSize);
+  if (result == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  return result;
+}
+
+void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+  trackAllocation(oldSize, newSize);
+
+  if (newSize == 0) {
+    free(pointer);
+    return NULL;
+  }
+
+  return checkedRealloc(pointer, newSize);
+}
+
+void* allocate(size_t size) {
+  trackAllocation(0, size);
+  if (size > POOL_MAX_SIZE) return checkedRealloc(NULL, size);
+
+  size_t slotSize = (size + POOL_GRANULE - 1) & ~(size_t) (POOL_GRANULE - 1);
+  SizeClass* sizeClass =
+    &get_VM()->pools.classes[slotSize / POOL_GRANULE - 1];
+
+  if (sizeClass->freeList != NULL) {
+    PoolSlot* slot = sizeClass->freeList;
+    sizeClass->freeList = slot->next;
+    return slot;
+  }
+
+  if (sizeClass->bump + slotSize > sizeClass->limit) {
+    ObjectPools* pools = &get_VM()->pools;
+    PoolPage* page = checkedRealloc(NULL, POOL_PAGE_SIZE);
+    page->next = pools->pages;
+    pools->pages = page;
+    sizeClass->bump = (char*) (page + 1);
+    sizeClass->limit = (char*) page + POOL_PAGE_SIZE;
+  }
+
+  void* result = sizeClass->bump;
+  sizeClass->bump += slotSize;
+  return result;
+}
+
+void deallocate(void* pointer, size_t size) {
+  trackAllocation(size, 0);
+  if (size > POOL_MAX_SIZE) {
+    free(pointer);
+    return;
+  }
+
+  size_t slotSize = (size + POOL_GRANULE - 1) & ~(size_t) (POOL_GRANULE - 1);
+  SizeClass* sizeClass =
+    &get_VM()->pools.classes[slotSize / POOL_GRANULE - 1];
+  PoolSlot* slot = pointer;
+  slot->next = sizeClass->freeList;
+  sizeClass->freeList = slot;
+}
+
+void initPools(void) {
+  memset(&get_VM()->pools, 0, sizeof(ObjectPools));
+}
+
+void freePools(void) {
+  ObjectPools* pools = &get_VM()->pools;
+  PoolPage* page = pools->pages;
+  while (page != NULL) {
+    PoolPage* next = page->next;
+    free(page);
+    page = next;
+  }
+  initPools();
+}
+
+void markObject(Obj* object) {
+  if (object == NULL || object->isMarked) return;
+#ifdef GC_GENERATIONAL
+  if (minorCollecting && object->isOld) return;
+#endif
+
+#ifdef DEBUG_LOG_GC
+  printf("%p mark ", (void*) object);
+  printValue(OBJ_VAL(object));
+  printf("\n");
+#endif
+
+  object->isMarked = true;
+  push_back_GrayStack(&get_VM()->grayStack, object);
+}
+
+void markValue(Value value) {
+  if (IS_OBJ(value)) markObject(AS_OBJ(value));
+}
+
+void rememberObject(Obj* object) {
+#ifdef GC_GENERATIONAL
+  if (object->isRemembered) return;
+  object->isRemembered = true;
+  push_back_GrayStack(&get_VM()->rememberedSet, object);
+#else
+  (void) object;
+#endif
+}
+
+void collectGarbage(void) {
+#ifdef GC_GENERATIONAL
+  VM* vm = get_VM();
+  // Promoted objects only get reclaimed by a full collection, which
+  // runs once the old generation has grown past nextGC.
+  if (vm->oldBytes > vm->nextGC)
+    majorCollection();
+  else
+    minorCollection();
+#else
+  majorCollection();
+#endif
+}
+
+static void majorCollection(void) {
+  VM* vm = get_VM();
+  uint64_t start = clockNs();
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+  size_t before = vm->bytesAllocated;
+#endif
+
+  markRoots();
+  traceReferences();
+  // Interned strings are weak: drop the ones nothing else refers to
+  // before sweep() frees them.
+  tableRemoveWhite(&vm->strings);
+  size_t live = sweep(&vm->objects, false);
+
+#ifdef GC_GENERATIONAL
+  // Everything that survives a full collection is old
+  live += sweep(&vm->nursery, true);
+  vm->oldBytes = live;
+  vm->nurseryBytes = 0;
+  for (int i = 0; i < vm->rememberedSet.size; i++)
+    vm->rememberedSet.data[i]->isRemembered = false;
+  vm->rememberedSet.size = 0;
+#endif
+
+  vm->nextGC = MAX(live * GC_HEAP_GROW_FACTOR, GC_INITIAL_THRESHOLD);
+  recordPause(true, clockNs() - start);
+
+#ifdef DEBUG_LOG_GC
+  printf("-- gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+      before - vm->bytesAllocated, before, vm->bytesAllocated,
+      vm->nextGC);
+#endif
+}
+
+#ifdef GC_GENERATIONAL
+static void minorCollection(void) {
+  VM* vm = get_VM();
+  uint64_t start = clockNs();
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
+#endif
+
+  minorCollecting = true;
+  markRoots();
+  // Old objects written to since the last collection may be the only
+  // path to some young ones
+  for (int i = 0; i < vm->rememberedSet.size; i++) {
+    Obj* object = vm->rememberedSet.data[i];
+    object->isRemembered = false;
+    blackenObject(object);
+  }
+  vm->rememberedSet.size = 0;
+  traceReferences();
+  minorCollecting = false;
+
+  // Unreached young strings are dropped from the intern table as they
+  // are freed, so there is no need to scan the whole table
+  size_t promoted = sweep(&vm->nursery, true);
+  vm->oldBytes += promoted;
+  vm->gcStats.promotedBytes += promoted;
+  vm->nurseryBytes = 0;
+
+  uint64_t pause = clockNs() - start;
+  recordPause(false, pause);
+
+  if (pause > vm->gcPauseBudget) {
+    vm->nurseryLimit = MAX(vm->nurseryLimit / 2, GC_NURSERY_MIN);
+  } else if (pause < vm->gcPauseBudget / 4
+      && vm->nurseryLimit < GC_NURSERY_MAX) {
+    vm->nurseryLimit *= 2;
+  }
+
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end: promoted %zu bytes, nursery now %zu\n",
+      promoted, vm->nurseryLimit);
+#endif
+}
+#endif
+
+static void markRoots(void) {
+  VM* vm = get_VM();
+  for (Value* slot = vm->stack; slot < vm->stackTop; slot++)
+    markValue(*slot);
+
+  for (int i = 0; i < vm->frameCount; i++)
+    markObject((Obj*) vm->frames[i].closure);
+
+  for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL;
+      upvalue = upvalue->next)
+    markObject((Obj*) upvalue);
+
+  markTable(&vm->globalSlots);
+  markArray(&vm->globalValues);
+  markCompilerRoots();
+  markRegisterCompilerRoots();
+  markSamplerRoots();
+  markImageRoots();
+}
+
+static void markArray(ValueArray* array) {
+  for (int i = 0; i < array->size; i++)
+    markValue(array->data[i]);
+}
+
+static void traceReferences(void) {
+  GrayStack* gray = &get_VM()->grayStack;
+  while (gray->size > 0) {
+    Obj* object = gray->data[--gray->size];
+    blackenObject(object);
+  }
+}
+
+static void blackenObject(Obj* object) {
+#ifdef DEBUG_LOG_GC
+  printf("%p blacken ", (void*) object);
+  printValue(OBJ_VAL(object));
+  printf("\n");
+#endif
+
+  switch (object->type) {
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*) object;
+      markObject((Obj*) closure->function);
+      for (int i = 0; i < closure->upvalueCount; i++)
+        markObject((Obj*) closure->upvalues[i]);
+      break;
+    }
+    case OBJ_UPVALUE:
+      markValue(((ObjUpvalue*) object)->closed);
+      break;
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*) object;
+      markObject((Obj*) function->name);
+      markObject((Obj*) function->lazySource);
+      markArray(&function->chunk.constants);
+      break;
+    }
+    case OBJ_BUILDER:
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+      break;
+  }
+}
+
+// Frees every unmarked object on the list and returns the number of
+// bytes still live. With `promote`, survivors move to the old list.
+static size_t sweep(Obj** list, bool promote) {
+  VM* vm = get_VM();
+  size_t live = 0;
+  Obj* previous = NULL;
+  Obj* object = *list;
+  while (object != NULL) {
+    if (object->isMarked) {
+      object->isMarked = false;
+      live += objectSize(object);
+      if (!promote) {
+        previous = object;
+        object = object->next;
+        continue;
+      }
+
+#ifdef GC_GENERATIONAL
+      Obj* survivor = object;
+      object = object->next;
+      if (previous != NULL)
+        previous->next = object;
+      else
+        *list = object;
+
+      survivor->isOld = true;
+      survivor->next = vm->objects;
+      vm->objects = survivor;
+#endif
+      continue;
+    }
+
+    Obj* unreached = object;
+    object = object->next;
+    if (previous != NULL)
+      previous->next = object;
+    else
+      *list = object;
+
+#ifdef GC_GENERATIONAL
+    if (promote && unreached->type == OBJ_STRING)
+      tableDelete(&vm->strings, (ObjString*) unreached);
+#endif
+    vm->gcStats.freedBytes += objectSize(unreached);
+    freeObject(unreached);
+  }
+  return live;
+}
+
+static uint64_t clockNs(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static void recordPause(bool major, uint64_t ns) {
+  GCStats* stats = &get_VM()->gcStats;
+  if (major) {
+    stats->majorCount++;
+    stats->majorTotalNs += ns;
+    stats->majorMaxNs = MAX(stats->majorMaxNs, ns);
+  } else {
+    stats->minorCount++;
+    stats->minorTotalNs += ns;
+    stats->minorMaxNs = MAX(stats->minorMaxNs, ns);
+  }
+}
+
+static double meanMs(uint64_t totalNs, int count) {
+  return count == 0 ? 0 : totalNs / 1e6 / count;
+}
+
+void printGCStats(void) {
+  VM* vm = get_VM();
+  GCStats* stats = &vm->gcStats;
+  fprintf(stderr, "-- gc stats\n");
+#ifdef GC_GENERATIONAL
+  fprintf(stderr, "   minor: %d collections, %.3f ms total, "
+      "%.3f ms mean, %.3f ms max pause\n", stats->minorCount,
+      stats->minorTotalNs / 1e6,
+      meanMs(stats->minorTotalNs, stats->minorCount),
+      stats->minorMaxNs / 1e6);
+  fprintf(stderr, "   promoted %zu bytes, nursery size %zu\n",
+      stats->promotedBytes, vm->nurseryLimit);
+#endif
+  fprintf(stderr, "   full:  %d collections, %.3f ms total, "
+      "%.3f ms mean, %.3f ms max pause\n", stats->majorCount,
+      stats->majorTotalNs / 1e6,
+      meanMs(stats->majorTotalNs, stats->majorCount),
+      stats->majorMaxNs / 1e6);
+  fprintf(stderr, "   freed %zu bytes, %zu bytes in use\n",
+      stats->freedBytes, vm->bytesAllocated);
+}
@@ -1,4 +1,6 @@
+#include <stdio.h>
 #include "object.h"
+#include "memory.h"
 #include "vm.h"
 #include "table.h"
 
@@ -7,60 +9,173 @@
   (type*) allocateObject(sizeof(type), objectType)
 
 
-static ObjString* allocateString(char*, int, uint32_t);
 static Obj* allocateObject(size_t size, ObjType type);
-static void freeObject(Obj*);
-static uint32_t hashString(const char* key, int length);
+static ObjString* allocateString(int length, uint32_t hash);
+static uint32_t hashString(uint32_t hash, const char* key, int length);
+static int textLength(Obj* text);
+static const char* textChars(Obj* text);
+static StringBuffer* newBuffer(int capacity);
+static void reserveBuffer(StringBuffer* buffer, int capacity);
+static void releaseBuffer(StringBuffer* buffer);
 
-ObjString* copyString(const char* chars, int length) {
-  char* heapChars = malloc(length + 1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
-  uint32_t hash = hashString(chars, length);
+// FNV-1a offset basis
+#define HASH_INIT 2166136261u
 
-  ObjString* interned = tableFindString(&get_VM()->strings, 
+// Both constructors look the string up before allocating, so an
+// already-interned string costs a hash and a compare but no object.
+ObjString* copyString(const char* chars, int length) {
+  uint32_t hash = hashString(HASH_INIT, chars, length);
+  ObjString* interned = tableFindString(&get_VM()->strings,
       chars, length, hash);
   if (interned) return interned;
 
-  return allocateString(heapChars, length, hash);
+  ObjString* string = allocateString(length, hash);
+  memcpy(string->chars, chars, length);
+  return string;
 }
 
-ObjString* takeString(char* chars, int length) {
-  uint32_t hash = hashString(chars, length);
+ObjString* concatStrings(ObjString* a, ObjString* b) {
+  // FNV-1a is a running hash, so a+b continues from a's hash
+  uint32_t hash = hashString(a->hash, b->chars, b->length);
+  ObjString* interned = tableFindConcat(&get_VM()->strings,
+      a, b, hash);
+  if (interned) return interned;
 
-  ObjString* interned = tableFindString(&get_VM()->strings, 
-      chars, length, hash);
-  if (interned) {
-    free(chars);
-    return interned;
+  ObjString* string = allocateString(a->length + b->length, hash);
+  memcpy(string->chars, a->chars, a->length);
+  memcpy(string->chars + a->length, b->chars, b->length);
+  return string;
+}
+
+// Concatenates two strings or builders. Short results are interned
+// strings; longer ones are builders.
+Obj* concatText(Obj* a, Obj* b) {
+  int length = textLength(a) + textLength(b);
+  if (length < BUILDER_MIN_LENGTH) {
+    // Builders are never this short, so both must be strings
+    return (Obj*) concatStrings((ObjString*) a, (ObjString*) b);
+  }
+
+  StringBuffer* buffer = NULL;
+  if (a->type == OBJ_BUILDER) {
+    ObjBuilder* builder = (ObjBuilder*) a;
+    // Only the builder that ends at the tip may append in place;
+    // any other would overwrite characters a longer builder sees
+    if (builder->length == builder->buffer->length)
+      buffer = builder->buffer;
+  }
+
+  if (buffer == NULL) {
+    buffer = newBuffer(length);
+    memcpy(buffer->chars, textChars(a), textLength(a));
+    buffer->length = textLength(a);
+  } else {
+    reserveBuffer(buffer, length);
   }
+  // b may share the buffer, so its characters are read only after
+  // it has been grown
+  memcpy(buffer->chars + buffer->length, textChars(b), textLength(b));
+  buffer->length = length;
+  buffer->refCount++;
+
+  ObjBuilder* builder = ALLOCATE_OBJ(ObjBuilder, OBJ_BUILDER);
+  builder->buffer = buffer;
+  builder->length = length;
+  return (Obj*) builder;
+}
+
+ObjBuilder* newBuilder(const char* chars, int length) {
+  StringBuffer* buffer = newBuffer(length);
+  memcpy(buffer->chars, chars, length);
+  buffer->length = length;
+  buffer->refCount = 1;
+
+  ObjBuilder* builder = ALLOCATE_OBJ(ObjBuilder, OBJ_BUILDER);
+  builder->buffer = buffer;
+  builder->length = length;
+  return builder;
+}
+
+bool objectsEqual(Obj* a, Obj* b) {
+  if (a == b) return true;
+  if ((a->type != OBJ_STRING && a->type != OBJ_BUILDER) ||
+      (b->type != OBJ_STRING && b->type != OBJ_BUILDER))
+    return false;
+  // Two distinct interned strings always differ
+  if (a->type == OBJ_STRING && b->type == OBJ_STRING) return false;
+  return textLength(a) == textLength(b) &&
+    memcmp(textChars(a), textChars(b), textLength(a)) == 0;
+}
+
+static int textLength(Obj* text) {
+  if (text->type == OBJ_BUILDER) return ((ObjBuilder*) text)->length;
+  return ((ObjString*) text)->length;
+}
+
+static const char* textChars(Obj* text) {
+  if (text->type == OBJ_BUILDER)
+    return ((ObjBuilder*) text)->buffer->chars;
+  return ((ObjString*) text)->chars;
+}
 
-  return allocateString(chars, length, hash);
+static StringBuffer* newBuffer(int capacity) {
+  StringBuffer* buffer = reallocate(NULL, 0, sizeof(StringBuffer));
+  buffer->length = 0;
+  buffer->capacity = 0;
+  buffer->refCount = 0;
+  buffer->chars = NULL;
+  reserveBuffer(buffer, capacity);
+  return buffer;
 }
 
-static ObjString* allocateString(char* chars, int length, 
-    uint32_t hash) {
-  ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+// Grows geometrically so repeated appends stay amortized linear
+static void reserveBuffer(StringBuffer* buffer, int capacity) {
+  if (capacity <= buffer->capacity) return;
+  int newCapacity = buffer->capacity < 8 ? 8 : buffer->capacity;
+  while (newCapacity < capacity) newCapacity *= 2;
+  buffer->chars = reallocate(buffer->chars, buffer->capacity,
+      newCapacity);
+  buffer->capacity = newCapacity;
+}
+
+static void releaseBuffer(StringBuffer* buffer) {
+  if (--buffer->refCount > 0) return;
+  reallocate(buffer->chars, buffer->capacity, 0);
+  reallocate(buffer, sizeof(StringBuffer), 0);
+}
+
+// Allocates and interns a string with room for `length` characters,
+// which the caller fills in. The table only compares keys by
+// identity, so it is safe to insert before the characters are set.
+static ObjString* allocateString(int length, uint32_t hash) {
+  ObjString* string = (ObjString*) allocateObject(
+      sizeof(ObjString) + length + 1, OBJ_STRING);
   string->length = length;
-  string->chars = chars;
   string->hash = hash;
+  string->chars[length] = '\0';
   tableSet(&get_VM()->strings, string, NIL_VAL);
   return string;
 }
 
 static Obj* allocateObject(size_t size, ObjType type) {
-  Obj* object = malloc(size);
+  Obj* object = (Obj*) allocate(size);
   object->type = type;
+  object->isMarked = false;
 
   VM* vm = get_VM();
+#ifdef GC_GENERATIONAL
+  object->isOld = false;
+  object->isRemembered = false;
+  object->next = vm->nursery;
+  vm->nursery = object;
+#else
   object->next = vm->objects;
   vm->objects = object;
+#endif
   return object;
 }
 
-void freeObjects(void) {
-  VM* vm = get_VM();
-  Obj* object = vm->objects;
+static void freeList(Obj* object) {
   while (object != NULL) {
     Obj* next = object->next;
     freeObject(object);
@@ -68,34 +183,59 @@ void freeObjects(void) {
   }
 }
 
-static void freeObject(Obj* object) {
+void freeObjects(void) {
+  VM* vm = get_VM();
+  freeList(vm->objects);
+#ifdef GC_GENERATIONAL
+  freeList(vm->nursery);
+  free_GrayStack(&vm->rememberedSet);
+#endif
+
+  free_GrayStack(&vm->grayStack);
+  freePools();
+}
+
+size_t objectSize(Obj* object) {
   switch (object->type) {
-    case OBJ_CLOSURE: {
-      free(object);
+    case OBJ_BUILDER:  return sizeof(ObjBuilder);
+    case OBJ_CLOSURE:
+      return sizeof(ObjClosure) +
+        ((ObjClosure*) object)->upvalueCount * sizeof(ObjUpvalue*);
+    case OBJ_FUNCTION: return sizeof(ObjFunction);
+    case OBJ_NATIVE:   return sizeof(ObjNative);
+    case OBJ_STRING:
+      return sizeof(ObjString) + ((ObjString*) object)->length + 1;
+    case OBJ_UPVALUE:  return sizeof(ObjUpvalue);
+  }
+  return 0;
+}
+
+void freeObject(Obj* object) {
+#ifdef DEBUG_LOG_GC
+  printf("%p free type %d\n", (void*) object, object->type);
+#endif
+
+  switch (object->type) {
+    case OBJ_BUILDER:
+      releaseBuffer(((ObjBuilder*) object)->buffer);
       break;
-    }
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*) object;
       free_Chunk(&function->chunk);
-      free(object);
       break;
     }
-    case OBJ_NATIVE: {
-      free(object);
+    case OBJ_CLOSURE:
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+    case OBJ_UPVALUE:
       break;
-    }
-    case OBJ_STRING: {
-      ObjString* string = (ObjString*) object;
-      free(string->chars);
-      free(object);
-      break;
-    }
   }
+
+  deallocate(object, objectSize(object));
 }
 
-static uint32_t hashString(const char* key, int length) {
-  // FNV-1a hashing algorithm
-  uint32_t hash = 2166136261u;
+static uint32_t hashString(uint32_t hash, const char* key,
+    int length) {
   for (int i = 0; i < length; ++i) {
     hash ^= (uint8_t) key[i];
     hash *= 16777619;
@@ -108,7 +248,11 @@ ObjFunction* newFunction(void) {
   ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->registerCount = 0;
   function->name = NULL;
+  function->lazySource = NULL;
+  function->lazyStart = 0;
+  function->lazyLine = 0;
   init_Chunk(&function->chunk);
   return function;
 }
@@ -120,7 +264,21 @@ ObjNative* newNative(NativeFn function) {
 }
 
 ObjClosure* newClosure(ObjFunction* function) {
-  ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+  int upvalueCount = function->upvalueCount;
+  ObjClosure* closure = (ObjClosure*) allocateObject(
+      sizeof(ObjClosure) + upvalueCount * sizeof(ObjUpvalue*),
+      OBJ_CLOSURE);
   closure->function = function;
+  closure->upvalueCount = upvalueCount;
+  for (int i = 0; i < upvalueCount; i++)
+    closure->upvalues[i] = NULL;
   return closure;
 }
+
+ObjUpvalue* newUpvalue(Value* slot) {
+  ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+  upvalue->location = slot;
+  upvalue->closed = NIL_VAL;
+  upvalue->next = NULL;
+  return upvalue;
+}
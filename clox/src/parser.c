@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <string.h>
+#include "parser.h"
+
+// Global variables
+Parser parser;
+
+// Binding power of each token used as an infix operator
+static Precedence precedences[] = {
+  [TOKEN_LEFT_PAREN]      = PREC_CALL,
+  [TOKEN_MINUS]           = PREC_TERM,
+  [TOKEN_PLUS]            = PREC_TERM,
+  [TOKEN_SLASH]           = PREC_FACTOR,
+  [TOKEN_STAR]            = PREC_FACTOR,
+  [TOKEN_BANG_EQUAL]      = PREC_EQUALITY,
+  [TOKEN_EQUAL_EQUAL]     = PREC_EQUALITY,
+  [TOKEN_GREATER]         = PREC_COMPARISON,
+  [TOKEN_GREATER_EQUAL]   = PREC_COMPARISON,
+  [TOKEN_LESS]            = PREC_COMPARISON,
+  [TOKEN_LESS_EQUAL]      = PREC_COMPARISON,
+  [TOKEN_AND]             = PREC_AND,
+  [TOKEN_OR]              = PREC_OR,
+  [TOKEN_EOF]             = PREC_NONE,
+};
+
+///////////////////////////////////////
+
+// Implementation
+
+void startParser(void) {
+  parser.hadError = false;
+  parser.panicMode = false;
+  advanceToken();
+}
+
+void advanceToken(void) {
+  parser.previous = parser.current;
+
+  for (;;) {
+    parser.current = scanToken();
+    if (parser.current.type != TOKEN_ERROR) break;
+
+    errorAtCurrent(parser.current.start);
+  }
+}
+
+void consume(TokenType type, const char* message) {
+  if (parser.current.type == type) {
+    advanceToken();
+    return;
+  }
+
+  errorAtCurrent(message);
+}
+
+bool check(TokenType type) {
+  return parser.current.type == type;
+}
+
+bool match(TokenType type) {
+  if (!check(type)) return false;
+  advanceToken();
+  return true;
+}
+
+void errorAt(Token* token, const char* message) {
+  if (parser.panicMode) return;
+
+  fprintf(stderr, "[line %d] Error", token->line);
+
+  if (token->type == TOKEN_EOF)
+    fprintf(stderr, " at end");
+  else if (token->type == TOKEN_ERROR)
+    ; // Nothing
+  else
+    fprintf(stderr, " at '%.*s'", token->length, token->start);
+
+  fprintf(stderr, ": %s\n", message);
+  parser.hadError = true;
+}
+
+void errorAtCurrent(const char* message) {
+  errorAt(&parser.current, message);
+}
+
+void errorAtPrevious(const char* message) {
+  errorAt(&parser.previous, message);
+}
+
+void synchronize(void) {
+  parser.panicMode = false;
+
+  while (parser.current.type != TOKEN_EOF) {
+    if (parser.previous.type == TOKEN_SEMICOLON) return;
+    switch (parser.current.type) {
+      case TOKEN_CLASS:
+      case TOKEN_FUN:
+      case TOKEN_VAR:
+      case TOKEN_FOR:
+      case TOKEN_IF:
+      case TOKEN_WHILE:
+      case TOKEN_PRINT:
+      case TOKEN_RETURN:
+        return;
+
+      default: ;
+    }
+    advanceToken();
+  }
+}
+
+bool identifiersEqual(Token* a, Token* b) {
+  if (a->length != b->length) return false;
+  return memcmp(a->start, b->start, a->length) == 0;
+}
+
+Precedence infixPrecedence(TokenType type) {
+  return precedences[type];
+}
+
+bool parseExpression(const ParseRule* rules, Precedence precedence,
+    void* e) {
+  advanceToken();
+  ParseFn prefixRule = rules[parser.previous.type].prefix;
+  if (!prefixRule) {
+    errorAtPrevious("Expect expression");
+    return false;
+  }
+
+  bool canAssign = precedence <= PREC_ASSIGNMENT;
+  prefixRule(e, canAssign);
+
+  while (precedence <= infixPrecedence(parser.current.type)) {
+    advanceToken();
+    ParseFn infixRule = rules[parser.previous.type].infix;
+    infixRule(e, canAssign);
+  }
+
+  if (canAssign && match(TOKEN_EQUAL)) {
+    errorAtPrevious("Invalid assignment target");
+  }
+  return true;
+}
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <time.h>
+#include "profile.h"
+#include "chunk.h"
+#include "debug.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TICK_UNIT "cycles"
+#else
+#define TICK_UNIT "ns"
+#endif
+
+#define NO_OP OP_LAST
+#define TOP_SEQUENCES 20
+
+typedef struct {
+  uint64_t count;
+  uint64_t ticks;
+} OpStats;
+
+typedef struct {
+  int index;
+  uint64_t count;
+} Ranked;
+
+static uint64_t readTicks(void);
+static int compareRanked(const void* a, const void* b);
+static int rankCounts(const uint64_t* counts, int size, Ranked* out);
+static void printSequence(int index, int length);
+
+static OpStats ops[OP_LAST];
+static uint64_t pairs[OP_LAST * OP_LAST];
+static uint64_t triples[OP_LAST * OP_LAST * OP_LAST];
+
+// The two previous opcodes and when the last one was dispatched
+static int prev = NO_OP, prevPrev = NO_OP;
+static uint64_t prevTicks;
+
+// Starts a new instruction stream, so nothing is counted across the
+// gap between two interpret() calls
+void profileBegin(void) {
+  prev = prevPrev = NO_OP;
+}
+
+void profileInstruction(uint8_t op) {
+  // A stray byte is reported by the interpreter, not counted
+  if (op >= OP_LAST) return;
+  uint64_t now = readTicks();
+  if (prev != NO_OP) {
+    // Time between dispatches belongs to the instruction before
+    ops[prev].ticks += now - prevTicks;
+    pairs[prev * OP_LAST + op]++;
+    if (prevPrev != NO_OP)
+      triples[(prevPrev * OP_LAST + prev) * OP_LAST + op]++;
+  }
+  ops[op].count++;
+  prevPrev = prev;
+  prev = op;
+  prevTicks = now;
+}
+
+void printOpcodeProfile(void) {
+  uint64_t total = 0, totalTicks = 0;
+  for (int i = 0; i < OP_LAST; i++) {
+    total += ops[i].count;
+    totalTicks += ops[i].ticks;
+  }
+  if (total == 0) return;
+
+  static Ranked ranked[OP_LAST * OP_LAST * OP_LAST];
+  static uint64_t counts[OP_LAST];
+  for (int i = 0; i < OP_LAST; i++) counts[i] = ops[i].count;
+
+  fprintf(stderr, "-- opcode profile: %llu instructions, %llu %s\n",
+      (unsigned long long) total, (unsigned long long) totalTicks,
+      TICK_UNIT);
+  fprintf(stderr, "   %-26s %12s %6s %14s %6s %8s\n", "opcode", "count",
+      "%", TICK_UNIT, "%", "per op");
+  int n = rankCounts(counts, OP_LAST, ranked);
+  for (int i = 0; i < n; i++) {
+    OpStats* stats = &ops[ranked[i].index];
+    fprintf(stderr, "   %-26s %12llu %5.1f%% %14llu %5.1f%% %8.1f\n",
+        opName((uint8_t) ranked[i].index),
+        (unsigned long long) stats->count, 100.0 * stats->count / total,
+        (unsigned long long) stats->ticks,
+        totalTicks ? 100.0 * stats->ticks / totalTicks : 0.0,
+        (double) stats->ticks / stats->count);
+  }
+
+  fprintf(stderr, "-- top opcode pairs\n");
+  n = rankCounts(pairs, OP_LAST * OP_LAST, ranked);
+  for (int i = 0; i < n && i < TOP_SEQUENCES; i++) {
+    fprintf(stderr, "   %12llu %5.1f%%  ",
+        (unsigned long long) ranked[i].count,
+        100.0 * ranked[i].count / total);
+    printSequence(ranked[i].index, 2);
+  }
+
+  fprintf(stderr, "-- top opcode triples\n");
+  n = rankCounts(triples, OP_LAST * OP_LAST * OP_LAST, ranked);
+  for (int i = 0; i < n && i < TOP_SEQUENCES; i++) {
+    fprintf(stderr, "   %12llu %5.1f%%  ",
+        (unsigned long long) ranked[i].count,
+        100.0 * ranked[i].count / total);
+    printSequence(ranked[i].index, 3);
+  }
+}
+
+static uint64_t readTicks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+static int compareRanked(const void* a, const void* b) {
+  uint64_t x = ((const Ranked*) a)->count;
+  uint64_t y = ((const Ranked*) b)->count;
+  return (x < y) - (x > y);
+}
+
+// Collects the non-zero counts, most frequent first
+static int rankCounts(const uint64_t* counts, int size, Ranked* out) {
+  int n = 0;
+  for (int i = 0; i < size; i++) {
+    if (counts[i] == 0) continue;
+    out[n].index = i;
+    out[n].count = counts[i];
+    n++;
+  }
+  qsort(out, n, sizeof(Ranked), compareRanked);
+  return n;
+}
+
+// Decodes a flattened pair or triple index back into opcode names
+static void printSequence(int index, int length) {
+  uint8_t sequence[3];
+  for (int i = length - 1; i >= 0; i--) {
+    sequence[i] = (uint8_t) (index % OP_LAST);
+    index /= OP_LAST;
+  }
+  for (int i = 0; i < length; i++)
+    fprintf(stderr, i == 0 ? "%s" : ", %s", opName(sequence[i]));
+  fputs("\n", stderr);
+}
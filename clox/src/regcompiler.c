@@ -0,0 +1,823 @@
+#include <stdio.h>
+#include <assert.h>
+#include "compiler.h"
+#include "common.h"
+#include "scanner.h"
+#include "parser.h"
+#include "object.h"
+#include "memory.h"
+#include "debug.h"
+#include "vm.h"
+
+// A second backend for the same grammar that emits three-address
+// register code (see the OP_REG_* opcodes in chunk.h). It shares the
+// front end in parser.c with compiler.c, and its rules describe each
+// expression with an ExpDesc. Local i lives in register i of the
+// frame, and temporaries are allocated stack-wise above the locals.
+// Closures over local variables are not supported.
+
+// Local typedefs
+// Where the value of an expression currently is
+typedef enum {
+  EXP_VOID,
+  EXP_NIL,
+  EXP_TRUE,
+  EXP_FALSE,
+  EXP_CONST,  // constant `info`, not loaded yet
+  EXP_LOCAL,  // local variable in register `info`
+  EXP_TEMP,   // temporary register `info`, the top one in use
+  EXP_RELOC,  // instruction at `info` still needs its destination
+} ExpKind;
+
+typedef struct {
+  ExpKind kind;
+  int info;
+} ExpDesc;
+
+typedef struct {
+  Token name;
+  int depth;
+} Local;
+
+typedef enum {
+  TYPE_FUNCTION,
+  TYPE_SCRIPT,
+} FunctionType;
+
+typedef struct RegCompiler {
+  struct RegCompiler* enclosing;
+  ObjFunction* function;
+  FunctionType type;
+
+  Local locals[UINT8_COUNT];
+  int localCount;
+  int scopeDepth;
+  // First register above the locals and live temporaries
+  int freeReg;
+  // Locals that are the pending left operand of a binary operator
+  int pinned[UINT8_COUNT];
+} RegCompiler;
+
+
+// Global variables
+static RegCompiler* current = NULL;
+
+
+// Parser utilities
+static void initCompiler(RegCompiler* compiler, FunctionType type);
+static ObjFunction* endCompiler(void);
+static void parsePrecedence(Precedence precedence, ExpDesc* e);
+static void beginScope(void);
+static void endScope(void);
+
+// Code generation
+static Chunk* currentChunk(void);
+static int emitABC(uint8_t op, int a, int b, int c);
+static int emitABx(uint8_t op, int a, int bx);
+static int emitJump(uint8_t op, int a);
+static void patchJump(int jump);
+static void emitLoop(int loopStart);
+static int makeConstant(Value value);
+static uint16_t identifierSlot(Token* name);
+
+// Registers
+static int reserveReg(void);
+static void freeExp(ExpDesc* e);
+static void dischargeToReg(ExpDesc* e, int reg);
+static int expToAnyReg(ExpDesc* e);
+static void expToNextReg(ExpDesc* e);
+static void expToReg(ExpDesc* e, int reg);
+static void discardExp(ExpDesc* e);
+
+// Name resolution
+static int addLocal(Token name);
+static int resolveLocal(RegCompiler* compiler, Token* name);
+static void markInitialized(void);
+
+// Expressions
+static void expression(ExpDesc* e);
+static void number(void* exp, bool canAssign);
+static void string(void* exp, bool canAssign);
+static void literal(void* exp, bool canAssign);
+static void grouping(void* exp, bool canAssign);
+static void unary(void* exp, bool canAssign);
+static void binary(void* exp, bool canAssign);
+static void variable(void* exp, bool canAssign);
+static void and_(void* exp, bool canAssign);
+static void or_(void* exp, bool canAssign);
+static void call(void* exp, bool canAssign);
+static void function(FunctionType type, int reg);
+
+// Statements
+static void declaration(void);
+static void block(void);
+static void varDeclaration(void);
+static void funDeclaration(void);
+static void statement(void);
+static void printStatement(void);
+static void expressionStatement(void);
+static void ifStatement(void);
+static void whileStatement(void);
+static void forStatement(void);
+static void returnStatement(void);
+
+// Parse table
+static ParseRule rules[] = {
+  [TOKEN_LEFT_PAREN]      = {grouping, call},
+  [TOKEN_RIGHT_PAREN]     = {NULL,     NULL},
+  [TOKEN_LEFT_BRACE]      = {NULL,     NULL},
+  [TOKEN_RIGHT_BRACE]     = {NULL,     NULL},
+  [TOKEN_COMMA]           = {NULL,     NULL},
+  [TOKEN_DOT]             = {NULL,     NULL},
+  [TOKEN_MINUS]           = {unary,    binary},
+  [TOKEN_PLUS]            = {NULL,     binary},
+  [TOKEN_SEMICOLON]       = {NULL,     NULL},
+  [TOKEN_SLASH]           = {NULL,     binary},
+  [TOKEN_STAR]            = {NULL,     binary},
+  [TOKEN_BANG]            = {unary,    NULL},
+  [TOKEN_BANG_EQUAL]      = {NULL,     binary},
+  [TOKEN_EQUAL]           = {NULL,     NULL},
+  [TOKEN_EQUAL_EQUAL]     = {NULL,     binary},
+  [TOKEN_GREATER]         = {NULL,     binary},
+  [TOKEN_GREATER_EQUAL]   = {NULL,     binary},
+  [TOKEN_LESS]            = {NULL,     binary},
+  [TOKEN_LESS_EQUAL]      = {NULL,     binary},
+  [TOKEN_IDENTIFIER]      = {variable, NULL},
+  [TOKEN_STRING]          = {string,   NULL},
+  [TOKEN_NUMBER]          = {number,   NULL},
+  [TOKEN_AND]             = {NULL,     and_},
+  [TOKEN_CLASS]           = {NULL,     NULL},
+  [TOKEN_ELSE]            = {NULL,     NULL},
+  [TOKEN_FALSE]           = {literal,  NULL},
+  [TOKEN_FOR]             = {NULL,     NULL},
+  [TOKEN_FUN]             = {NULL,     NULL},
+  [TOKEN_IF]              = {NULL,     NULL},
+  [TOKEN_NIL]             = {literal,  NULL},
+  [TOKEN_OR]              = {NULL,     or_},
+  [TOKEN_PRINT]           = {NULL,     NULL},
+  [TOKEN_RETURN]          = {NULL,     NULL},
+  [TOKEN_SUPER]           = {NULL,     NULL},
+  [TOKEN_THIS]            = {NULL,     NULL},
+  [TOKEN_TRUE]            = {literal,  NULL},
+  [TOKEN_VAR]             = {NULL,     NULL},
+  [TOKEN_WHILE]           = {NULL,     NULL},
+  [TOKEN_ERROR]           = {NULL,     NULL},
+  [TOKEN_EOF]             = {NULL,     NULL},
+};
+
+///////////////////////////////////////
+
+// Implementation
+
+ObjFunction* compileRegisters(const char* source) {
+  initScanner(source);
+  RegCompiler compiler;
+  initCompiler(&compiler, TYPE_SCRIPT);
+
+  startParser();
+
+  while (!match(TOKEN_EOF))
+    declaration();
+
+  ObjFunction* function = endCompiler();
+  return parser.hadError ? NULL : function;
+}
+
+void markRegisterCompilerRoots(void) {
+  for (RegCompiler* compiler = current; compiler != NULL;
+      compiler = compiler->enclosing)
+    markObject((Obj*) compiler->function);
+}
+
+static Chunk* currentChunk(void) {
+  return &current->function->chunk;
+}
+
+static void initCompiler(RegCompiler* compiler, FunctionType type) {
+  compiler->enclosing = current;
+  compiler->function = NULL;
+  compiler->type = type;
+  compiler->localCount = 0;
+  compiler->scopeDepth = 0;
+  memset(compiler->pinned, 0, sizeof(compiler->pinned));
+  compiler->function = newFunction();
+  current = compiler;
+
+  if (type != TYPE_SCRIPT) {
+    current->function->name = copyString(parser.previous.start,
+        parser.previous.length);
+    WRITE_BARRIER(&current->function->obj,
+        OBJ_VAL(current->function->name));
+  }
+
+  // Register 0 holds the function being called
+  Local* local = &current->locals[current->localCount++];
+  local->depth = 0;
+  local->name.start = "";
+  local->name.length = 0;
+  current->freeReg = 1;
+  current->function->registerCount = 1;
+}
+
+static ObjFunction* endCompiler(void) {
+  int reg = reserveReg();
+  emitABC(OP_REG_LOAD_NIL, reg, 0, 0);
+  emitABC(OP_REG_RETURN, reg, 0, 0);
+  ObjFunction* function = current->function;
+
+  if (get_VM()->printCode && !parser.hadError)
+    disassembleChunk(currentChunk(), function->name != NULL
+        ? function->name->chars : "<script>");
+
+  current = current->enclosing;
+  return function;
+}
+
+static int emitABC(uint8_t op, int a, int b, int c) {
+  Chunk* chunk = currentChunk();
+  int line = parser.previous.line;
+  writeChunk(chunk, op, line);
+  writeChunk(chunk, (uint8_t) a, line);
+  writeChunk(chunk, (uint8_t) b, line);
+  writeChunk(chunk, (uint8_t) c, line);
+  return chunk->code.size - 4;
+}
+
+static int emitABx(uint8_t op, int a, int bx) {
+  return emitABC(op, a, (bx >> 8) & 0xff, bx & 0xff);
+}
+
+static int emitJump(uint8_t op, int a) {
+  return emitABx(op, a, 0xffff);
+}
+
+// Points the jump at `jump` to the next instruction
+static void patchJump(int jump) {
+  int offset = currentChunk()->code.size - (jump + 4);
+  if (offset > INT16_MAX)
+    errorAtPrevious("Too much code to jump over");
+
+  currentChunk()->code.data[jump + 2] = (offset >> 8) & 0xff;
+  currentChunk()->code.data[jump + 3] = offset & 0xff;
+}
+
+static void emitLoop(int loopStart) {
+  int offset = loopStart - (currentChunk()->code.size + 4);
+  if (offset < INT16_MIN) errorAtPrevious("Loop body too large");
+
+  emitABx(OP_REG_JUMP, 0, (uint16_t) (int16_t) offset);
+}
+
+static int makeConstant(Value value) {
+  int constant = addConstant(currentChunk(), value);
+  WRITE_BARRIER(&current->function->obj, value);
+  if (constant > UINT16_MAX) {
+    errorAtPrevious("Too many constants in one chunk");
+    return 0;
+  }
+
+  return constant;
+}
+
+static uint16_t identifierSlot(Token* name) {
+  int slot = globalSlot(copyString(name->start, name->length));
+  if (slot > UINT16_MAX) {
+    errorAtPrevious("Too many global variables");
+    return 0;
+  }
+
+  return (uint16_t) slot;
+}
+
+static int reserveReg(void) {
+  if (current->freeReg == UINT8_COUNT) {
+    errorAtPrevious("Expression needs too many registers");
+    return 0;
+  }
+
+  int reg = current->freeReg++;
+  if (current->freeReg > current->function->registerCount)
+    current->function->registerCount = current->freeReg;
+  return reg;
+}
+
+static void freeExp(ExpDesc* e) {
+  if (e->kind != EXP_TEMP) return;
+  assert(e->info == current->freeReg - 1 || parser.hadError);
+  current->freeReg--;
+}
+
+static void dischargeToReg(ExpDesc* e, int reg) {
+  switch (e->kind) {
+    case EXP_NIL:   emitABC(OP_REG_LOAD_NIL, reg, 0, 0); break;
+    case EXP_TRUE:  emitABC(OP_REG_LOAD_TRUE, reg, 0, 0); break;
+    case EXP_FALSE: emitABC(OP_REG_LOAD_FALSE, reg, 0, 0); break;
+    case EXP_CONST:
+      emitABx(OP_REG_LOAD_CONSTANT, reg, e->info);
+      break;
+    case EXP_RELOC:
+      currentChunk()->code.data[e->info + 1] = (uint8_t) reg;
+      break;
+    case EXP_LOCAL:
+    case EXP_TEMP:
+      if (e->info != reg) emitABC(OP_REG_MOVE, reg, e->info, 0);
+      break;
+    case EXP_VOID:
+      break;
+  }
+}
+
+// Makes sure the value is in some register and returns it
+static int expToAnyReg(ExpDesc* e) {
+  if (e->kind == EXP_LOCAL || e->kind == EXP_TEMP) return e->info;
+  expToNextReg(e);
+  return e->info;
+}
+
+// Moves the value into a fresh temporary on top of the others
+static void expToNextReg(ExpDesc* e) {
+  freeExp(e);
+  int reg = reserveReg();
+  dischargeToReg(e, reg);
+  e->kind = EXP_TEMP;
+  e->info = reg;
+}
+
+// Stores the value into `reg`, which is not a live temporary
+static void expToReg(ExpDesc* e, int reg) {
+  dischargeToReg(e, reg);
+  freeExp(e);
+}
+
+// Evaluates an expression whose value is not needed. Only pending
+// instructions have side effects; they get a scratch destination.
+static void discardExp(ExpDesc* e) {
+  if (e->kind == EXP_RELOC) expToAnyReg(e);
+  freeExp(e);
+}
+
+static void parsePrecedence(Precedence precedence, ExpDesc* e) {
+  if (!parseExpression(rules, precedence, e)) e->kind = EXP_NIL;
+}
+
+static void expression(ExpDesc* e) {
+  parsePrecedence(PREC_ASSIGNMENT, e);
+}
+
+static void number(void* exp, bool canAssign) {
+  ExpDesc* e = exp;
+  double value = strtod(parser.previous.start, NULL);
+  e->kind = EXP_CONST;
+  e->info = makeConstant(NUMBER_VAL(value));
+}
+
+static void string(void* exp, bool canAssign) {
+  ExpDesc* e = exp;
+  e->kind = EXP_CONST;
+  e->info = makeConstant(OBJ_VAL(copyString(parser.previous.start + 1,
+          parser.previous.length - 2)));
+}
+
+static void literal(void* exp, bool canAssign) {
+  ExpDesc* e = exp;
+  switch (parser.previous.type) {
+    case TOKEN_FALSE: e->kind = EXP_FALSE; break;
+    case TOKEN_NIL: e->kind = EXP_NIL; break;
+    case TOKEN_TRUE: e->kind = EXP_TRUE; break;
+    default: assert(false); // unreachable
+  }
+}
+
+static void grouping(void* exp, bool canAssign) {
+  ExpDesc* e = exp;
+  expression(e);
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression");
+}
+
+static void unary(void* exp, bool canAssign) {
+  ExpDesc* e = exp;
+  TokenType operatorType = parser.previous.type;
+
+  // Compile the operand
+  parsePrecedence(PREC_UNARY, e);
+  int operand = expToAnyReg(e);
+  freeExp(e);
+
+  // Emit the operator instruction, leaving the destination open
+  uint8_t op = operatorType == TOKEN_BANG ? OP_REG_NOT : OP_REG_NEGATE;
+  e->kind = EXP_RELOC;
+  e->info = emitABC(op, 0, operand, 0);
+}
+
+static void binary(void* exp, bool canAssign) {
+  ExpDesc* e = exp;
+  TokenType operatorType = parser.previous.type;
+
+  // The left operand must be in a register before the right one is
+  // compiled. A local can be used in place, so it is pinned against
+  // assignment until the operator has read it.
+  if (e->kind != EXP_LOCAL) expToAnyReg(e);
+  if (e->kind == EXP_LOCAL) current->pinned[e->info]++;
+
+  ExpDesc right;
+  parsePrecedence((Precedence) (infixPrecedence(operatorType) + 1),
+      &right);
+
+  if (e->kind == EXP_LOCAL) current->pinned[e->info]--;
+
+  uint8_t op;
+  switch (operatorType) {
+    case TOKEN_BANG_EQUAL:    op = OP_REG_NOT_EQUAL;     break;
+    case TOKEN_EQUAL_EQUAL:   op = OP_REG_EQUAL;         break;
+    case TOKEN_GREATER:       op = OP_REG_GREATER;       break;
+    case TOKEN_GREATER_EQUAL: op = OP_REG_GREATER_EQUAL; break;
+    case TOKEN_LESS:          op = OP_REG_LESS;          break;
+    case TOKEN_LESS_EQUAL:    op = OP_REG_LESS_EQUAL;    break;
+    case TOKEN_PLUS:          op = OP_REG_ADD;           break;
+    case TOKEN_MINUS:         op = OP_REG_SUBTRACT;      break;
+    case TOKEN_STAR:          op = OP_REG_MULTIPLY;      break;
+    case TOKEN_SLASH:         op = OP_REG_DIVIDE;        break;
+    default: assert(false); return; // Unreachable
+  }
+
+  int c;
+  if (right.kind == EXP_CONST && right.info <= UINT8_MAX) {
+    // Each operator's _CONST form is the same distance away
+    op += OP_REG_ADD_CONST - OP_REG_ADD;
+    c = right.info;
+  } else {
+    c = expToAnyReg(&right);
+  }
+  freeExp(&right);
+  freeExp(e);
+
+  int b = e->info;
+  e->kind = EXP_RELOC;
+  e->info = emitABC(op, 0, b, c);
+}
+
+static void and_(void* exp, bool canAssign) {
+  ExpDesc* e = exp;
+  expToNextReg(e);
+  int endJump = emitJump(OP_REG_JUMP_IF_FALSE, e->info);
+
+  ExpDesc right;
+  parsePrecedence(PREC_AND, &right);
+  expToReg(&right, e->info);
+  patchJump(endJump);
+}
+
+static void or_(void* exp, bool canAssign) {
+  ExpDesc* e = exp;
+  expToNextReg(e);
+  int endJump = emitJump(OP_REG_JUMP_IF_TRUE, e->info);
+
+  ExpDesc right;
+  parsePrecedence(PREC_OR, &right);
+  expToReg(&right, e->info);
+  patchJump(endJump);
+}
+
+static void variable(void* exp, bool canAssign) {
+  ExpDesc* e = exp;
+  Token name = parser.previous;
+  int reg = resolveLocal(current, &name);
+
+  if (reg == -1) {
+    for (RegCompiler* c = current->enclosing; c != NULL;
+        c = c->enclosing) {
+      if (resolveLocal(c, &name) != -1) {
+        errorAtPrevious("Closures over local variables are not supported "
+            "in register mode");
+        break;
+      }
+    }
+  }
+
+  if (reg != -1) {
+    if (canAssign && match(TOKEN_EQUAL)) {
+      if (current->pinned[reg] > 0)
+        errorAtPrevious("Can't assign to a variable that is an operand of "
+            "the enclosing expression in register mode");
+      ExpDesc value;
+      expression(&value);
+      expToReg(&value, reg);
+    }
+    e->kind = EXP_LOCAL;
+    e->info = reg;
+    return;
+  }
+
+  uint16_t slot = identifierSlot(&name);
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expression(e);
+    emitABx(OP_REG_SET_GLOBAL, expToAnyReg(e), slot);
+  } else {
+    e->kind = EXP_RELOC;
+    e->info = emitABx(OP_REG_GET_GLOBAL, 0, slot);
+  }
+}
+
+static void call(void* exp, bool canAssign) {
+  ExpDesc* e = exp;
+  // The callee and its arguments go in consecutive registers, which
+  // become the bottom of the called function's frame
+  expToNextReg(e);
+  int base = e->info;
+
+  int argCount = 0;
+  if (!check(TOKEN_RIGHT_PAREN)) {
+    do {
+      ExpDesc arg;
+      expression(&arg);
+      expToNextReg(&arg);
+      if (argCount == 255)
+        errorAtPrevious("Can't have more than 255 arguments");
+      argCount++;
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments");
+
+  emitABC(OP_REG_CALL, base, argCount, 0);
+  current->freeReg = base + 1;
+}
+
+static void declaration(void) {
+  if (match(TOKEN_FUN)) {
+    funDeclaration();
+  } else if (match(TOKEN_VAR))
+    varDeclaration();
+  else
+    statement();
+
+  // Statements leave no temporaries behind
+  current->freeReg = current->localCount;
+
+  if (parser.panicMode)
+    synchronize();
+}
+
+static void statement(void) {
+  if (match(TOKEN_PRINT)) {
+    printStatement();
+  } else if (match(TOKEN_RETURN)) {
+    returnStatement();
+  } else if (match(TOKEN_IF)) {
+    ifStatement();
+  } else if (match(TOKEN_FOR)) {
+    forStatement();
+  } else if (match(TOKEN_WHILE)) {
+    whileStatement();
+  } else if (match(TOKEN_LEFT_BRACE)) {
+    beginScope();
+    block();
+    endScope();
+  } else {
+    expressionStatement();
+  }
+}
+
+static void printStatement(void) {
+  ExpDesc value;
+  expression(&value);
+  consume(TOKEN_SEMICOLON, "Expect ';' after value");
+  emitABC(OP_REG_PRINT, expToAnyReg(&value), 0, 0);
+  freeExp(&value);
+}
+
+static void expressionStatement(void) {
+  ExpDesc value;
+  expression(&value);
+  consume(TOKEN_SEMICOLON, "Expect ';' after expression");
+  discardExp(&value);
+}
+
+static void varDeclaration(void) {
+  consume(TOKEN_IDENTIFIER, "Expect variable name");
+  Token name = parser.previous;
+
+  if (current->scopeDepth == 0) {
+    uint16_t slot = identifierSlot(&name);
+    ExpDesc value = {EXP_NIL, 0};
+    if (match(TOKEN_EQUAL)) expression(&value);
+    consume(TOKEN_SEMICOLON,
+        "Expect ';' after variable declaration");
+    emitABx(OP_REG_DEFINE_GLOBAL, expToAnyReg(&value), slot);
+    freeExp(&value);
+    return;
+  }
+
+  // The new local's register is free until the initializer is done,
+  // so the initializer can compute straight into it
+  int reg = addLocal(name);
+  ExpDesc value = {EXP_NIL, 0};
+  if (match(TOKEN_EQUAL)) expression(&value);
+  consume(TOKEN_SEMICOLON,
+      "Expect ';' after variable declaration");
+  expToReg(&value, reg);
+  markInitialized();
+}
+
+static void block(void) {
+  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+    declaration();
+
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block");
+}
+
+static void beginScope(void) {
+  current->scopeDepth++;
+}
+
+// Locals are registers, so leaving a scope emits nothing
+static void endScope(void) {
+  current->scopeDepth--;
+
+  while (current->localCount > 0 &&
+      current->locals[current->localCount - 1].depth
+      > current->scopeDepth) {
+    current->localCount--;
+  }
+  current->freeReg = current->localCount;
+}
+
+// Declares a local in the current scope and returns its register
+static int addLocal(Token name) {
+  for (int i = current->localCount - 1; i >= 0; i--) {
+    Local* local = &current->locals[i];
+    if (local->depth != -1 && local->depth < current->scopeDepth)
+      break;
+
+    if (identifiersEqual(&name, &local->name))
+      errorAtPrevious("Already a variable with this name in this scope");
+  }
+
+  if (current->localCount == UINT8_COUNT) {
+    errorAtPrevious("Too many local variables in function");
+    return 0;
+  }
+
+  Local* local = &current->locals[current->localCount++];
+  local->name = name;
+  local->depth = -1;
+  return current->localCount - 1;
+}
+
+static int resolveLocal(RegCompiler* compiler, Token* name) {
+  for (int i = compiler->localCount - 1; i >= 0; i--) {
+    Local* local = &compiler->locals[i];
+    if (identifiersEqual(name, &local->name)) {
+      if (local->depth == -1 && compiler == current) {
+        errorAtPrevious("Can't read local variable in its own initializer");
+      }
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static void markInitialized(void) {
+  current->locals[current->localCount - 1].depth =
+    current->scopeDepth;
+  current->freeReg = current->localCount;
+  if (current->freeReg > current->function->registerCount)
+    current->function->registerCount = current->freeReg;
+}
+
+static void ifStatement(void) {
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'");
+  ExpDesc condition;
+  expression(&condition);
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition");
+
+  int thenJump = emitJump(OP_REG_JUMP_IF_FALSE,
+      expToAnyReg(&condition));
+  freeExp(&condition);
+  statement();
+
+  if (match(TOKEN_ELSE)) {
+    int elseJump = emitJump(OP_REG_JUMP, 0);
+    patchJump(thenJump);
+    statement();
+    patchJump(elseJump);
+  } else {
+    patchJump(thenJump);
+  }
+}
+
+static void whileStatement(void) {
+  int loopStart = currentChunk()->code.size;
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'");
+  ExpDesc condition;
+  expression(&condition);
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition");
+
+  int exitJump = emitJump(OP_REG_JUMP_IF_FALSE,
+      expToAnyReg(&condition));
+  freeExp(&condition);
+  statement();
+  emitLoop(loopStart);
+
+  patchJump(exitJump);
+}
+
+static void forStatement(void) {
+  beginScope();
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'");
+  if (match(TOKEN_SEMICOLON)) {
+    // No initializer
+  } else if (match(TOKEN_VAR)) {
+    varDeclaration();
+  } else {
+    expressionStatement();
+  }
+
+  int loopStart = currentChunk()->code.size;
+  int exitJump = -1;
+  if (!match(TOKEN_SEMICOLON)) {
+    ExpDesc condition;
+    expression(&condition);
+    consume(TOKEN_SEMICOLON, "Expect ';' after loop condition");
+    exitJump = emitJump(OP_REG_JUMP_IF_FALSE,
+        expToAnyReg(&condition));
+    freeExp(&condition);
+  }
+  if (!match(TOKEN_RIGHT_PAREN)) {
+    int bodyJump = emitJump(OP_REG_JUMP, 0);
+    int incrementStart = currentChunk()->code.size;
+    ExpDesc increment;
+    expression(&increment);
+    discardExp(&increment);
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses");
+
+    emitLoop(loopStart);
+    loopStart = incrementStart;
+    patchJump(bodyJump);
+  }
+
+  statement();
+  current->freeReg = current->localCount;
+  emitLoop(loopStart);
+
+  if (exitJump != -1) patchJump(exitJump);
+
+  endScope();
+}
+
+static void funDeclaration(void) {
+  consume(TOKEN_IDENTIFIER, "Expect function name.");
+  Token name = parser.previous;
+
+  if (current->scopeDepth == 0) {
+    uint16_t slot = identifierSlot(&name);
+    int reg = reserveReg();
+    function(TYPE_FUNCTION, reg);
+    emitABx(OP_REG_DEFINE_GLOBAL, reg, slot);
+    return;
+  }
+
+  int reg = addLocal(name);
+  markInitialized();
+  function(TYPE_FUNCTION, reg);
+}
+
+static void function(FunctionType type, int reg) {
+  RegCompiler compiler;
+  initCompiler(&compiler, type);
+  beginScope();
+
+  // Parameters are locals 1..arity, filled in by the caller
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after function name");
+  if (!check(TOKEN_RIGHT_PAREN)) {
+    do {
+      current->function->arity++;
+      if (current->function->arity > 255) {
+        errorAtCurrent("Can't have more than 255 parameters");
+      }
+      consume(TOKEN_IDENTIFIER, "Expect parameter name");
+      addLocal(parser.previous);
+      markInitialized();
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters");
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before function body");
+  block();
+
+  ObjFunction* function = endCompiler();
+  emitABx(OP_REG_CLOSURE, reg, makeConstant(OBJ_VAL(function)));
+}
+
+static void returnStatement(void) {
+  if (current->type == TYPE_SCRIPT) {
+    errorAtPrevious("Can't return from top-level code");
+  }
+
+  ExpDesc value = {EXP_NIL, 0};
+  if (!match(TOKEN_SEMICOLON)) {
+    expression(&value);
+    consume(TOKEN_SEMICOLON, "Expect ';' after return value");
+  }
+  emitABC(OP_REG_RETURN, expToAnyReg(&value), 0, 0);
+  freeExp(&value);
+}
@@ -0,0 +1,371 @@
+#include <stdio.h>
+#include <stdatomic.h>
+#include "vm.h"
+#include "value.h"
+#include "debug.h"
+#include "compiler.h"
+#include "chunk.h"
+#include "object.h"
+#include "profile.h"
+
+// Interpreter loop for the register instruction set. Each frame's
+// registers are a window of vm.stack starting at frame->slots;
+// vm.stackTop is kept at the top of the innermost window so the
+// collector sees every live register.
+
+static InterpretResult run(void);
+static bool callValue(Value* base, int argCount);
+static bool call(ObjClosure* closure, Value* base, int argCount);
+static void traceInstruction(CallFrame* frame);
+
+InterpretResult interpretRegisters(const char* source) {
+  ObjFunction* function = compileRegisters(source);
+  if (function == NULL) return INTERPRET_COMPILE_ERROR;
+
+  push(OBJ_VAL(function));
+  ObjClosure* closure = newClosure(function);
+  pop();
+  push(OBJ_VAL(closure));
+  if (!call(closure, get_VM()->stackTop - 1, 0))
+    return INTERPRET_RUNTIME_ERROR;
+
+  return run();
+}
+
+static InterpretResult run(void) {
+  VM* vm = get_VM();
+  CallFrame* frame = &vm->frames[vm->frameCount - 1];
+#define READ_INSTRUCTION() (frame->ip += 4)
+#define OP      (frame->ip[-4])
+#define A       (frame->ip[-3])
+#define B       (frame->ip[-2])
+#define C       (frame->ip[-1])
+#define BX      ((uint16_t) ((B << 8) | C))
+#define SBX     ((int16_t) BX)
+#define R(i)    (frame->slots[i])
+#define K(i)    (frame->closure->function->chunk.constants.data[i])
+#define ARITH_OP(valueType, op, left, right) \
+  do { \
+    Value l = (left), r = (right); \
+    if (!IS_NUMBER(l) || !IS_NUMBER(r)) { \
+      runtimeError("Operands must be numbers"); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } \
+    R(A) = valueType(AS_NUMBER(l) op AS_NUMBER(r)); \
+  } while (false)
+// a <= b and a >= b are !(a > b) and !(a < b), as in the stack VM
+#define NOT_OP(valueType, op, left, right) \
+  do { \
+    Value l = (left), r = (right); \
+    if (!IS_NUMBER(l) || !IS_NUMBER(r)) { \
+      runtimeError("Operands must be numbers"); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } \
+    R(A) = valueType(!(AS_NUMBER(l) op AS_NUMBER(r))); \
+  } while (false)
+
+#ifdef PROFILE_OPCODES
+#define PROFILE_INSTRUCTION() profileInstruction(*frame->ip)
+#else
+#define PROFILE_INSTRUCTION() do { } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#pragma GCC diagnostic ignored "-Woverride-init"
+  static void* dispatchTable[UINT8_MAX + 1] = {
+    [0 ... UINT8_MAX] = &&op_unknown,
+    [OP_REG_MOVE]                = &&op_OP_REG_MOVE,
+    [OP_REG_LOAD_CONSTANT]       = &&op_OP_REG_LOAD_CONSTANT,
+    [OP_REG_LOAD_NIL]            = &&op_OP_REG_LOAD_NIL,
+    [OP_REG_LOAD_TRUE]           = &&op_OP_REG_LOAD_TRUE,
+    [OP_REG_LOAD_FALSE]          = &&op_OP_REG_LOAD_FALSE,
+    [OP_REG_DEFINE_GLOBAL]       = &&op_OP_REG_DEFINE_GLOBAL,
+    [OP_REG_GET_GLOBAL]          = &&op_OP_REG_GET_GLOBAL,
+    [OP_REG_SET_GLOBAL]          = &&op_OP_REG_SET_GLOBAL,
+    [OP_REG_ADD]                 = &&op_OP_REG_ADD,
+    [OP_REG_SUBTRACT]            = &&op_OP_REG_SUBTRACT,
+    [OP_REG_MULTIPLY]            = &&op_OP_REG_MULTIPLY,
+    [OP_REG_DIVIDE]              = &&op_OP_REG_DIVIDE,
+    [OP_REG_EQUAL]               = &&op_OP_REG_EQUAL,
+    [OP_REG_NOT_EQUAL]           = &&op_OP_REG_NOT_EQUAL,
+    [OP_REG_LESS]                = &&op_OP_REG_LESS,
+    [OP_REG_LESS_EQUAL]          = &&op_OP_REG_LESS_EQUAL,
+    [OP_REG_GREATER]             = &&op_OP_REG_GREATER,
+    [OP_REG_GREATER_EQUAL]       = &&op_OP_REG_GREATER_EQUAL,
+    [OP_REG_ADD_CONST]           = &&op_OP_REG_ADD_CONST,
+    [OP_REG_SUBTRACT_CONST]      = &&op_OP_REG_SUBTRACT_CONST,
+    [OP_REG_MULTIPLY_CONST]      = &&op_OP_REG_MULTIPLY_CONST,
+    [OP_REG_DIVIDE_CONST]        = &&op_OP_REG_DIVIDE_CONST,
+    [OP_REG_EQUAL_CONST]         = &&op_OP_REG_EQUAL_CONST,
+    [OP_REG_NOT_EQUAL_CONST]     = &&op_OP_REG_NOT_EQUAL_CONST,
+    [OP_REG_LESS_CONST]          = &&op_OP_REG_LESS_CONST,
+    [OP_REG_LESS_EQUAL_CONST]    = &&op_OP_REG_LESS_EQUAL_CONST,
+    [OP_REG_GREATER_CONST]       = &&op_OP_REG_GREATER_CONST,
+    [OP_REG_GREATER_EQUAL_CONST] = &&op_OP_REG_GREATER_EQUAL_CONST,
+    [OP_REG_NOT]                 = &&op_OP_REG_NOT,
+    [OP_REG_NEGATE]              = &&op_OP_REG_NEGATE,
+    [OP_REG_JUMP]                = &&op_OP_REG_JUMP,
+    [OP_REG_JUMP_IF_FALSE]       = &&op_OP_REG_JUMP_IF_FALSE,
+    [OP_REG_JUMP_IF_TRUE]        = &&op_OP_REG_JUMP_IF_TRUE,
+    [OP_REG_PRINT]               = &&op_OP_REG_PRINT,
+    [OP_REG_CALL]                = &&op_OP_REG_CALL,
+    [OP_REG_RETURN]              = &&op_OP_REG_RETURN,
+    [OP_REG_CLOSURE]             = &&op_OP_REG_CLOSURE,
+  };
+  // Same --trace scheme as the stack VM
+  static void* traceTable[UINT8_MAX + 1] = { [0 ... UINT8_MAX] = &&op_trace };
+  void** dispatch = vm->traceExecution ? traceTable : dispatchTable;
+#define INTERPRET_LOOP  DISPATCH();
+#define CASE(op)        op_##op
+#define DEFAULT         op_unknown
+#define DISPATCH() \
+  do { \
+    PROFILE_INSTRUCTION(); \
+    READ_INSTRUCTION(); \
+    goto *dispatch[OP]; \
+  } while (false)
+#else
+  bool trace = vm->traceExecution;
+#define INTERPRET_LOOP \
+  loop: \
+    if (trace) traceInstruction(frame); \
+    PROFILE_INSTRUCTION(); \
+    READ_INSTRUCTION(); \
+    switch (OP)
+#define CASE(op)        case op
+#define DEFAULT         default
+#define DISPATCH()      goto loop
+#endif
+
+#ifdef PROFILE_OPCODES
+  profileBegin();
+#endif
+  INTERPRET_LOOP
+  {
+    CASE(OP_REG_MOVE):          R(A) = R(B); DISPATCH();
+    CASE(OP_REG_LOAD_CONSTANT): R(A) = K(BX); DISPATCH();
+    CASE(OP_REG_LOAD_NIL):      R(A) = NIL_VAL; DISPATCH();
+    CASE(OP_REG_LOAD_TRUE):     R(A) = BOOL_VAL(true); DISPATCH();
+    CASE(OP_REG_LOAD_FALSE):    R(A) = BOOL_VAL(false); DISPATCH();
+    CASE(OP_REG_DEFINE_GLOBAL):
+      vm->globalValues.data[BX] = R(A);
+      DISPATCH();
+    CASE(OP_REG_GET_GLOBAL): {
+      Value value = vm->globalValues.data[BX];
+      if (IS_UNDEFINED(value)) {
+        runtimeError("Undefined variable '%s'",
+            AS_CSTRING(vm->globalNames.data[BX]));
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      R(A) = value;
+      DISPATCH();
+    }
+    CASE(OP_REG_SET_GLOBAL): {
+      if (IS_UNDEFINED(vm->globalValues.data[BX])) {
+        runtimeError("Undefined variable '%s'",
+            AS_CSTRING(vm->globalNames.data[BX]));
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      vm->globalValues.data[BX] = R(A);
+      DISPATCH();
+    }
+    CASE(OP_REG_ADD):
+    CASE(OP_REG_ADD_CONST): {
+      Value left = R(B);
+      Value right = OP == OP_REG_ADD ? R(C) : K(C);
+      if (IS_NUMBER(left) && IS_NUMBER(right)) {
+        R(A) = NUMBER_VAL(AS_NUMBER(left) + AS_NUMBER(right));
+      } else if (IS_TEXT(left) && IS_TEXT(right)) {
+        // Both operands are in registers, so they stay reachable
+        // while the result is allocated
+        R(A) = OBJ_VAL(concatText(AS_OBJ(left), AS_OBJ(right)));
+      } else {
+        runtimeError(
+            "Operands must be two numbers or two strings");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(OP_REG_SUBTRACT): ARITH_OP(NUMBER_VAL, -, R(B), R(C)); DISPATCH();
+    CASE(OP_REG_MULTIPLY): ARITH_OP(NUMBER_VAL, *, R(B), R(C)); DISPATCH();
+    CASE(OP_REG_DIVIDE):   ARITH_OP(NUMBER_VAL, /, R(B), R(C)); DISPATCH();
+    CASE(OP_REG_LESS):     ARITH_OP(BOOL_VAL, <, R(B), R(C)); DISPATCH();
+    CASE(OP_REG_GREATER):  ARITH_OP(BOOL_VAL, >, R(B), R(C)); DISPATCH();
+    CASE(OP_REG_LESS_EQUAL):
+      NOT_OP(BOOL_VAL, >, R(B), R(C)); DISPATCH();
+    CASE(OP_REG_GREATER_EQUAL):
+      NOT_OP(BOOL_VAL, <, R(B), R(C)); DISPATCH();
+    CASE(OP_REG_SUBTRACT_CONST):
+      ARITH_OP(NUMBER_VAL, -, R(B), K(C)); DISPATCH();
+    CASE(OP_REG_MULTIPLY_CONST):
+      ARITH_OP(NUMBER_VAL, *, R(B), K(C)); DISPATCH();
+    CASE(OP_REG_DIVIDE_CONST):
+      ARITH_OP(NUMBER_VAL, /, R(B), K(C)); DISPATCH();
+    CASE(OP_REG_LESS_CONST):
+      ARITH_OP(BOOL_VAL, <, R(B), K(C)); DISPATCH();
+    CASE(OP_REG_GREATER_CONST):
+      ARITH_OP(BOOL_VAL, >, R(B), K(C)); DISPATCH();
+    CASE(OP_REG_LESS_EQUAL_CONST):
+      NOT_OP(BOOL_VAL, >, R(B), K(C)); DISPATCH();
+    CASE(OP_REG_GREATER_EQUAL_CONST):
+      NOT_OP(BOOL_VAL, <, R(B), K(C)); DISPATCH();
+    CASE(OP_REG_EQUAL):
+      R(A) = BOOL_VAL(valuesEqual(R(B), R(C))); DISPATCH();
+    CASE(OP_REG_NOT_EQUAL):
+      R(A) = BOOL_VAL(!valuesEqual(R(B), R(C))); DISPATCH();
+    CASE(OP_REG_EQUAL_CONST):
+      R(A) = BOOL_VAL(valuesEqual(R(B), K(C))); DISPATCH();
+    CASE(OP_REG_NOT_EQUAL_CONST):
+      R(A) = BOOL_VAL(!valuesEqual(R(B), K(C))); DISPATCH();
+    CASE(OP_REG_NOT):
+      R(A) = BOOL_VAL(isFalsey(R(B)));
+      DISPATCH();
+    CASE(OP_REG_NEGATE):
+      if (!IS_NUMBER(R(B))) {
+        runtimeError("Operand must be a number");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      R(A) = NUMBER_VAL(-AS_NUMBER(R(B)));
+      DISPATCH();
+    CASE(OP_REG_JUMP):
+      frame->ip += SBX;
+      DISPATCH();
+    CASE(OP_REG_JUMP_IF_FALSE):
+      if (isFalsey(R(A))) frame->ip += SBX;
+      DISPATCH();
+    CASE(OP_REG_JUMP_IF_TRUE):
+      if (!isFalsey(R(A))) frame->ip += SBX;
+      DISPATCH();
+    CASE(OP_REG_PRINT):
+      printValue(R(A));
+      puts("");
+      DISPATCH();
+    CASE(OP_REG_CALL):
+      if (!callValue(&R(A), B)) return INTERPRET_RUNTIME_ERROR;
+      frame = &vm->frames[vm->frameCount - 1];
+      DISPATCH();
+    CASE(OP_REG_RETURN): {
+      Value result = R(A);
+      vm->frameCount--;
+      if (vm->frameCount == 0) {
+        vm->stackTop = vm->stack;
+        return INTERPRET_OK;
+      }
+
+      // The callee sat in the caller's register that receives the
+      // result
+      frame->slots[0] = result;
+      frame = &vm->frames[vm->frameCount - 1];
+      vm->stackTop = frame->slots
+        + frame->closure->function->registerCount;
+      DISPATCH();
+    }
+    CASE(OP_REG_CLOSURE):
+      R(A) = OBJ_VAL(newClosure(AS_FUNCTION(K(BX))));
+      DISPATCH();
+    DEFAULT:
+      runtimeError("Unknown opcode %d", OP);
+      return INTERPRET_RUNTIME_ERROR;
+#ifdef COMPUTED_GOTO
+    op_trace:
+      frame->ip -= 4;
+      traceInstruction(frame);
+      READ_INSTRUCTION();
+      goto *dispatchTable[OP];
+#endif
+  }
+
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+#undef READ_INSTRUCTION
+#undef OP
+#undef A
+#undef B
+#undef C
+#undef BX
+#undef SBX
+#undef R
+#undef K
+#undef ARITH_OP
+#undef NOT_OP
+#undef PROFILE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DEFAULT
+#undef DISPATCH
+}
+
+static void traceInstruction(CallFrame* frame) {
+  VM* vm = get_VM();
+  fputs("          ", stdout);
+  for (Value* slot = frame->slots; slot < vm->stackTop; slot++) {
+    fputs("[ ", stdout);
+    printValue(*slot);
+    fputs(" ]", stdout);
+  }
+  puts("");
+
+  disassembleInstruction(&frame->closure->function->chunk,
+      (int) (frame->ip - frame->closure->function->chunk.code.data));
+}
+
+// Calls the value in base[0] with the arguments after it
+static bool callValue(Value* base, int argCount) {
+  Value callee = *base;
+  if (IS_OBJ(callee)) {
+    switch (OBJ_TYPE(callee)) {
+      case OBJ_CLOSURE:
+        return call(AS_CLOSURE(callee), base, argCount);
+      case OBJ_NATIVE:
+        *base = AS_NATIVE(callee)(argCount, base + 1);
+        return true;
+      default:
+        break;
+    }
+  }
+  runtimeError("Can only call functions and classes");
+  return false;
+}
+
+static bool call(ObjClosure* closure, Value* base, int argCount) {
+  VM* vm = get_VM();
+  ObjFunction* function = closure->function;
+  if (argCount != function->arity) {
+    runtimeError("Expected %d arguments but got %d",
+        function->arity, argCount);
+    return false;
+  }
+
+  // Deferred bodies only compile to stack bytecode
+  if (function->lazySource != NULL) {
+    runtimeError("Could not compile %s() for the register VM",
+        function->name->chars);
+    return false;
+  }
+
+  if (vm->frameCount == FRAMES_MAX ||
+      base + function->registerCount > vm->stack + STACK_MAX) {
+    runtimeError("Stack overflow");
+    return false;
+  }
+
+  // Registers past the arguments may hold stale values from earlier
+  // calls; clear them before the collector can see them
+  for (Value* slot = base + argCount + 1;
+      slot < base + function->registerCount; slot++)
+    *slot = NIL_VAL;
+
+  CallFrame* frame = &vm->frames[vm->frameCount];
+  frame->closure = closure;
+  frame->ip = function->chunk.code.data;
+  frame->slots = base;
+  // Published after it is filled in, as in the stack VM
+  atomic_signal_fence(memory_order_release);
+  vm->frameCount++;
+  vm->stackTop = base + function->registerCount;
+  return true;
+}
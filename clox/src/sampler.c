@@ -0,0 +1,163 @@
+#define _XOPEN_SOURCE 700
+#include <signal.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include "sampler.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#define SAMPLE_INTERVAL_US 1000
+#define MAX_RECORDS (1 << 20)
+#define MAX_STACK_TEXT 4096
+
+// The signal handler only copies raw frames into a preallocated
+// buffer; names and lines are resolved when the profile is written.
+// Each sample is a header record (function NULL, offset = depth)
+// followed by one record per frame, outermost first.
+typedef struct {
+  ObjFunction* function;
+  int offset;
+} FrameRecord;
+
+static void takeSample(int signal);
+static int frameLine(FrameRecord* record);
+static int appendFrame(char* buffer, int length, FrameRecord* record);
+static int compareStacks(const void* a, const void* b);
+
+static FrameRecord* records = NULL;
+static volatile sig_atomic_t recordCount = 0;
+static volatile sig_atomic_t droppedSamples = 0;
+static const char* outputPath;
+
+bool startSampler(const char* path) {
+  records = malloc(MAX_RECORDS * sizeof(FrameRecord));
+  if (records == NULL) return false;
+  outputPath = path;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = takeSample;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, NULL) != 0) return false;
+
+  // CPU-time timers fire on scheduler ticks, so the real interval
+  // is at least one tick (4ms with HZ=250)
+  struct itimerval timer;
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = SAMPLE_INTERVAL_US;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, NULL) != 0) return false;
+
+  // Scripts that fail exit() without returning to main
+  atexit(stopSampler);
+  return true;
+}
+
+// Stops the timer and writes the profile; later calls do nothing
+void stopSampler(void) {
+  if (records == NULL) return;
+
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  signal(SIGPROF, SIG_IGN);
+
+  FILE* file = fopen(outputPath, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Could not write profile \"%s\"\n", outputPath);
+    free(records);
+    records = NULL;
+    return;
+  }
+
+  // One "frame;frame;frame" string per sample, then count runs of
+  // equal stacks after sorting
+  int count = recordCount;
+  int sampleCount = 0;
+  char** stacks = malloc((count + 1) * sizeof(char*));
+  for (int i = 0; i < count; i += records[i].offset + 1) {
+    char buffer[MAX_STACK_TEXT];
+    int length = 0;
+    for (int j = 1; j <= records[i].offset; j++) {
+      if (j > 1 && length < MAX_STACK_TEXT - 1) buffer[length++] = ';';
+      length = appendFrame(buffer, length, &records[i + j]);
+    }
+    buffer[length] = '\0';
+    stacks[sampleCount++] = strdup(buffer);
+  }
+  qsort(stacks, sampleCount, sizeof(char*), compareStacks);
+
+  for (int i = 0; i < sampleCount; ) {
+    int run = 1;
+    while (i + run < sampleCount && strcmp(stacks[i], stacks[i + run]) == 0)
+      run++;
+    fprintf(file, "%s %d\n", stacks[i], run);
+    for (int j = 0; j < run; j++) free(stacks[i + j]);
+    i += run;
+  }
+  fclose(file);
+
+  if (droppedSamples > 0)
+    fprintf(stderr, "Profile buffer full, dropped %d samples\n",
+        (int) droppedSamples);
+  free(stacks);
+  free(records);
+  records = NULL;
+}
+
+// Sampled functions must outlive the run so their names can be
+// printed. Anything sampled while this runs is on the frame stack
+// and already reachable.
+void markSamplerRoots(void) {
+  if (records == NULL) return;
+  int count = recordCount;
+  for (int i = 0; i < count; i++) {
+    if (records[i].function != NULL)
+      markObject((Obj*) records[i].function);
+  }
+}
+
+static void takeSample(int signal) {
+  (void) signal;
+  VM* vm = get_VM();
+  int depth = vm->frameCount;
+  int count = recordCount;
+  if (depth == 0) return;
+  if (count + depth + 1 > MAX_RECORDS) {
+    droppedSamples++;
+    return;
+  }
+
+  records[count].function = NULL;
+  records[count].offset = depth;
+  for (int i = 0; i < depth; i++) {
+    CallFrame* frame = &vm->frames[i];
+    ObjFunction* function = frame->closure->function;
+    records[count + 1 + i].function = function;
+    records[count + 1 + i].offset =
+      (int) (frame->ip - function->chunk.code.data);
+  }
+  recordCount = count + depth + 1;
+}
+
+// ip has already moved past the instruction being executed, or past
+// the call in callers' frames
+static int frameLine(FrameRecord* record) {
+  int offset = record->offset > 0 ? record->offset - 1 : 0;
+  return getLine(&record->function->chunk, offset);
+}
+
+static int appendFrame(char* buffer, int length, FrameRecord* record) {
+  ObjString* name = record->function->name;
+  int space = MAX_STACK_TEXT - length;
+  int written = snprintf(buffer + length, space, "%s:%d",
+      name != NULL ? name->chars : "<script>", frameLine(record));
+  // Stacks too deep for the buffer are cut off
+  return written < space ? length + written : MAX_STACK_TEXT - 1;
+}
+
+static int compareStacks(const void* a, const void* b) {
+  return strcmp(*(char* const*) a, *(char* const*) b);
+}
@@ -33,9 +33,13 @@ static Scanner scanner;
 // Implementation
 
 void initScanner(const char* source) {
+  initScannerAt(source, 1);
+}
+
+void initScannerAt(const char* source, int line) {
   scanner.start = source;
   scanner.current = source;
-  scanner.line = 1;
+  scanner.line = line;
 }
 
 Token scanToken(void) {
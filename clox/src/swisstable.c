@@ -0,0 +1,264 @@
+#include "table.h"
+#include "memory.h"
+#include "object.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Control bytes: a full slot stores the low 7 bits of its key's hash,
+// so most non-matching slots are rejected without touching the entry.
+#define CTRL_EMPTY   ((uint8_t) 0x80)
+#define CTRL_DELETED ((uint8_t) 0xFE)
+#define IS_FULL(ctrl) ((ctrl) < 0x80)
+
+#define GROUP_WIDTH 16
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((uint8_t) ((hash) & 0x7F))
+
+// Bit i of a group mask is set when slot i of the group matches
+typedef uint32_t GroupMask;
+
+static GroupMask matchByte(const uint8_t* group, uint8_t byte);
+static GroupMask matchEmpty(const uint8_t* group);
+static GroupMask matchFree(const uint8_t* group);
+static Entry* findEntry(Table* table, ObjString* key);
+static Entry* findFreeSlot(Table* table, uint32_t hash);
+static void setCtrl(Table* table, Entry* entry, uint8_t ctrl);
+static void resize(Table* table, int capacity);
+
+// Groups are probed in triangular order (+1, +2, +3, ... groups),
+// which visits every group when the group count is a power of two
+#define FOR_EACH_GROUP(table, hash, group) \
+  for (uint32_t group = H1(hash) & (table)->groupMask, step_ = 1; ; \
+      group = (group + step_++) & (table)->groupMask)
+
+#define FOR_EACH_BIT(mask, bit) \
+  for (GroupMask m_ = (mask); m_ != 0; m_ &= m_ - 1) \
+    for (int bit = __builtin_ctz(m_), once_ = 1; once_; once_ = 0)
+
+void init_Table(Table* table) {
+  table->size = 0;
+  table->capacity = 0;
+  table->growthLeft = 0;
+  table->groupMask = 0;
+  table->ctrl = NULL;
+  table->data = NULL;
+}
+
+void free_Table(Table* table) {
+  free(table->ctrl);
+  free(table->data);
+  init_Table(table);
+}
+
+bool tableSet(Table* table, ObjString* key, Value value) {
+  Entry* entry = findEntry(table, key);
+  if (entry != NULL) {
+    entry->value = value;
+    return false;
+  }
+
+  entry = findFreeSlot(table, key->hash);
+  int index = (int) (entry - table->data);
+  if (table->ctrl[index] == CTRL_EMPTY) {
+    if (table->growthLeft == 0) {
+      // Grow if mostly live, otherwise just drop the tombstones
+      resize(table, table->size * 2 >= table->capacity * 7 / 8 ?
+          table->capacity * 2 : table->capacity);
+      entry = findFreeSlot(table, key->hash);
+    }
+    table->growthLeft--;
+  }
+
+  setCtrl(table, entry, H2(key->hash));
+  entry->key = key;
+  entry->value = value;
+  table->size++;
+  return true;
+}
+
+bool tableGet(Table* table, ObjString* key, Value* value) {
+  if (table->size == 0) return false;
+
+  Entry* entry = findEntry(table, key);
+  if (entry == NULL) return false;
+
+  *value = entry->value;
+  return true;
+}
+
+bool tableDelete(Table* table, ObjString* key) {
+  if (table->size == 0) return false;
+
+  Entry* entry = findEntry(table, key);
+  if (entry == NULL) return false;
+
+  // A probe that reaches a group with an empty slot stops there, so
+  // if this group still has one the slot can go straight back to
+  // empty instead of becoming a tombstone
+  int index = (int) (entry - table->data);
+  const uint8_t* group = table->ctrl + (index & ~(GROUP_WIDTH - 1));
+  if (matchEmpty(group) != 0) {
+    setCtrl(table, entry, CTRL_EMPTY);
+    table->growthLeft++;
+  } else {
+    setCtrl(table, entry, CTRL_DELETED);
+  }
+  entry->key = NULL;
+  entry->value = NIL_VAL;
+  table->size--;
+  return true;
+}
+
+void tableAddAll(Table* from, Table* to) {
+  for (int i = 0; i < from->capacity; ++i) {
+    if (IS_FULL(from->ctrl[i]))
+      tableSet(to, from->data[i].key, from->data[i].value);
+  }
+}
+
+ObjString* tableFindString(Table* table, const char* chars,
+    int length, uint32_t hash) {
+  if (table->size == 0) return NULL;
+
+  FOR_EACH_GROUP(table, hash, group) {
+    const uint8_t* ctrl = table->ctrl + group * GROUP_WIDTH;
+    FOR_EACH_BIT(matchByte(ctrl, H2(hash)), bit) {
+      ObjString* key = table->data[group * GROUP_WIDTH + bit].key;
+      if (key->length == length && key->hash == hash &&
+          memcmp(key->chars, chars, length) == 0)
+        return key;
+    }
+    if (matchEmpty(ctrl) != 0) return NULL;
+  }
+}
+
+ObjString* tableFindConcat(Table* table, ObjString* a,
+    ObjString* b, uint32_t hash) {
+  if (table->size == 0) return NULL;
+
+  int length = a->length + b->length;
+  FOR_EACH_GROUP(table, hash, group) {
+    const uint8_t* ctrl = table->ctrl + group * GROUP_WIDTH;
+    FOR_EACH_BIT(matchByte(ctrl, H2(hash)), bit) {
+      ObjString* key = table->data[group * GROUP_WIDTH + bit].key;
+      if (key->length == length && key->hash == hash &&
+          memcmp(key->chars, a->chars, a->length) == 0 &&
+          memcmp(key->chars + a->length, b->chars, b->length) == 0)
+        return key;
+    }
+    if (matchEmpty(ctrl) != 0) return NULL;
+  }
+}
+
+void tableRemoveWhite(Table* table) {
+  for (int i = 0; i < table->capacity; ++i) {
+    if (IS_FULL(table->ctrl[i]) && !table->data[i].key->obj.isMarked)
+      tableDelete(table, table->data[i].key);
+  }
+}
+
+void markTable(Table* table) {
+  for (int i = 0; i < table->capacity; ++i) {
+    if (!IS_FULL(table->ctrl[i])) continue;
+    markObject((Obj*) table->data[i].key);
+    markValue(table->data[i].value);
+  }
+}
+
+static Entry* findEntry(Table* table, ObjString* key) {
+  if (table->capacity == 0) return NULL;
+
+  FOR_EACH_GROUP(table, key->hash, group) {
+    const uint8_t* ctrl = table->ctrl + group * GROUP_WIDTH;
+    FOR_EACH_BIT(matchByte(ctrl, H2(key->hash)), bit) {
+      Entry* entry = table->data + group * GROUP_WIDTH + bit;
+      if (entry->key == key) return entry;
+    }
+    if (matchEmpty(ctrl) != 0) return NULL;
+  }
+}
+
+// Returns the first empty or deleted slot on the key's probe sequence
+static Entry* findFreeSlot(Table* table, uint32_t hash) {
+  if (table->capacity == 0) resize(table, GROUP_WIDTH);
+
+  FOR_EACH_GROUP(table, hash, group) {
+    GroupMask free = matchFree(table->ctrl + group * GROUP_WIDTH);
+    if (free != 0)
+      return table->data + group * GROUP_WIDTH + __builtin_ctz(free);
+  }
+}
+
+static void setCtrl(Table* table, Entry* entry, uint8_t ctrl) {
+  table->ctrl[entry - table->data] = ctrl;
+}
+
+static void resize(Table* table, int capacity) {
+  Table old = *table;
+
+  table->capacity = capacity;
+  table->groupMask = (uint32_t) (capacity / GROUP_WIDTH - 1);
+  // Groups are loaded with aligned 16-byte loads
+  table->ctrl = aligned_alloc(GROUP_WIDTH, capacity);
+  table->data = malloc(capacity * sizeof(Entry));
+  memset(table->ctrl, CTRL_EMPTY, capacity);
+  table->size = 0;
+  // Keep the load at or below 7/8
+  table->growthLeft = capacity - capacity / 8;
+
+  // Re-insert live entries, dropping tombstones
+  for (int i = 0; i < old.capacity; ++i) {
+    if (!IS_FULL(old.ctrl[i])) continue;
+    Entry* dest = findFreeSlot(table, old.data[i].key->hash);
+    setCtrl(table, dest, old.ctrl[i]);
+    *dest = old.data[i];
+    table->size++;
+    table->growthLeft--;
+  }
+
+  free(old.ctrl);
+  free(old.data);
+}
+
+#ifdef __SSE2__
+
+static GroupMask matchByte(const uint8_t* group, uint8_t byte) {
+  __m128i ctrl = _mm_load_si128((const __m128i*) group);
+  return (GroupMask) _mm_movemask_epi8(
+      _mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char) byte)));
+}
+
+static GroupMask matchEmpty(const uint8_t* group) {
+  return matchByte(group, CTRL_EMPTY);
+}
+
+// Empty and deleted are the only control bytes with the top bit set,
+// which is exactly what movemask collects
+static GroupMask matchFree(const uint8_t* group) {
+  return (GroupMask) _mm_movemask_epi8(
+      _mm_load_si128((const __m128i*) group));
+}
+
+#else
+
+static GroupMask matchByte(const uint8_t* group, uint8_t byte) {
+  GroupMask mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; ++i)
+    mask |= (GroupMask) (group[i] == byte) << i;
+  return mask;
+}
+
+static GroupMask matchEmpty(const uint8_t* group) {
+  return matchByte(group, CTRL_EMPTY);
+}
+
+static GroupMask matchFree(const uint8_t* group) {
+  GroupMask mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; ++i)
+    mask |= (GroupMask) !IS_FULL(group[i]) << i;
+  return mask;
+}
+
+#endif
@@ -1,4 +1,5 @@
 #include "table.h"
+#include "memory.h"
 #include "object.h"
 
 VECTOR_IMPL(Table, Entry)
@@ -22,7 +23,7 @@ bool tableSet(Table* table, ObjString* key, Value value) {
 
 static Entry* findEntry(Entry* entries, int capacity,
     ObjString* key) {
-  uint32_t index = key->hash % capacity;
+  uint32_t index = key->hash & (capacity - 1);
   Entry* tombstone = NULL;
 
   for (;;) {
@@ -40,7 +41,7 @@ static Entry* findEntry(Entry* entries, int capacity,
       return entry;
     }
 
-    index = (index + 1) % capacity;
+    index = (index + 1) & (capacity - 1);
   }
 }
 
@@ -48,8 +49,11 @@ static void adjustCapacity(Table* table, int capacity) {
   Table new_table;
   init_Table(&new_table);
 
-  // Avoid adjusting to zero capacity
-  capacity = MAX(capacity, 8);
+  // Capacities are powers of two (at least 8) so probes can mask
+  // instead of dividing
+  int powerOfTwo = 8;
+  while (powerOfTwo < capacity) powerOfTwo *= 2;
+  capacity = powerOfTwo;
 
   reserve_Table(&new_table, capacity);
   // Zero out all new buckets
@@ -59,8 +63,8 @@ static void adjustCapacity(Table* table, int capacity) {
   }
   
 
-  // Re-hash the table
-  table->size = 0;
+  // Re-hash the table, dropping tombstones
+  new_table.size = 0;
   for (int i = 0; i < table->capacity; ++i) {
     Entry* entry = table->data + i;
     if (entry->key == NULL) continue;
@@ -68,7 +72,7 @@ static void adjustCapacity(Table* table, int capacity) {
     Entry* dest = findEntry(new_table.data, capacity, entry->key);
     dest->key = entry->key;
     dest->value = entry->value;
-    table->size++;
+    new_table.size++;
   }
 
   free_Table(table);
@@ -113,7 +117,8 @@ ObjString* tableFindString(Table* table, const char* chars,
     int length, uint32_t hash) {
   if (table->size == 0) return NULL;
 
-  uint32_t index = hash % table->capacity;
+  uint32_t mask = table->capacity - 1;
+  uint32_t index = hash & mask;
   for (;;) {
     Entry* entry = table->data + index;
     if (entry->key == NULL) {
@@ -125,7 +130,46 @@ ObjString* tableFindString(Table* table, const char* chars,
       // Found it
       return entry->key;
     }
-    index = (index + 1) % table->capacity;
+    index = (index + 1) & mask;
   }
+}
+
+// Like tableFindString, but for the characters of a followed by b,
+// so a concatenation can be looked up without building it first
+ObjString* tableFindConcat(Table* table, ObjString* a,
+    ObjString* b, uint32_t hash) {
+  if (table->size == 0) return NULL;
+
+  int length = a->length + b->length;
+  uint32_t mask = table->capacity - 1;
+  uint32_t index = hash & mask;
+  for (;;) {
+    Entry* entry = table->data + index;
+    if (entry->key == NULL) {
+      if (IS_NIL(entry->value)) return NULL;
+    } else if (entry->key->length == length &&
+        entry->key->hash == hash &&
+        memcmp(entry->key->chars, a->chars, a->length) == 0 &&
+        memcmp(entry->key->chars + a->length, b->chars,
+          b->length) == 0) {
+      return entry->key;
+    }
+    index = (index + 1) & mask;
+  }
+}
 
+void tableRemoveWhite(Table* table) {
+  for (int i = 0; i < table->capacity; ++i) {
+    Entry* entry = table->data + i;
+    if (entry->key != NULL && !entry->key->obj.isMarked)
+      tableDelete(table, entry->key);
+  }
+}
+
+void markTable(Table* table) {
+  for (int i = 0; i < table->capacity; ++i) {
+    Entry* entry = table->data + i;
+    markObject((Obj*) entry->key);
+    markValue(entry->value);
+  }
 }
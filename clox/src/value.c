@@ -9,35 +9,43 @@ void printObject(Value value);
 static void printFunction(ObjFunction*);
 
 void printValue(Value value) {
-  switch (value.type) {
-    case VAL_BOOL:
-      printf(AS_BOOL(value) ? "true" : "false");
-      break;
-    case VAL_NIL:
-      printf("nil"); 
-      break;
-    case VAL_NUMBER: 
-      printf("%g", AS_NUMBER(value)); 
-      break;
-    case VAL_OBJ:
-      printObject(value);
-      break;
+  if (IS_BOOL(value)) {
+    printf(AS_BOOL(value) ? "true" : "false");
+  } else if (IS_NIL(value)) {
+    printf("nil");
+  } else if (IS_NUMBER(value)) {
+    printf("%g", AS_NUMBER(value));
+  } else if (IS_OBJ(value)) {
+    printObject(value);
   }
 }
 
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+  // Compare doubles as doubles so that NaN != NaN and 0 == -0
+  if (IS_NUMBER(a) && IS_NUMBER(b))
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  if (IS_OBJ(a) && IS_OBJ(b)) return objectsEqual(AS_OBJ(a), AS_OBJ(b));
+  return a == b;
+#else
   if (a.type != b.type) return false;
   switch (a.type) {
     case VAL_BOOL:    return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL:     return true;
+    case VAL_UNDEFINED: return true;
     case VAL_NUMBER:  return AS_NUMBER(a) == AS_NUMBER(b);
-    case VAL_OBJ:     return AS_OBJ(a) == AS_OBJ(b);
+    case VAL_OBJ:     return objectsEqual(AS_OBJ(a), AS_OBJ(b));
     default:          assert(false); return false; // unreachable
   }
+#endif
 }
 
 void printObject(Value value) {
   switch (OBJ_TYPE(value)) {
+    case OBJ_BUILDER:
+      printf("%.*s", AS_BUILDER(value)->length,
+          AS_BUILDER(value)->buffer->chars);
+      break;
     case OBJ_STRING:
       printf("%s", AS_CSTRING(value));
       break;
@@ -50,6 +58,9 @@ void printObject(Value value) {
     case OBJ_CLOSURE:
       printFunction(AS_CLOSURE(value)->function);
       break;
+    case OBJ_UPVALUE:
+      printf("upvalue");
+      break;
   }
 }
 
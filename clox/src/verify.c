@@ -0,0 +1,434 @@
+#include <stdlib.h>
+#include "verify.h"
+#include "vm.h"
+
+// A frame never holds more values than this, so that FRAMES_MAX
+// frames fit in vm.stack (STACK_MAX). One slot is kept free for the
+// operand OP_ADD_CONSTANT and OP_ADD_INT push on their slow path.
+#define FRAME_SLOTS (UINT8_COUNT - 1)
+
+typedef struct {
+  ObjFunction* function;
+  int globalCount;
+  bool* starts;     // Whether an instruction starts at each offset
+  int* heights;     // Stack height before each instruction, or -1
+  int* pending;     // Reached instructions still to be checked
+  int pendingCount;
+} Verifier;
+
+static int instructionLength(Chunk* chunk, int offset);
+static bool checkOperands(Verifier* verifier, int offset);
+static bool checkFlow(Verifier* verifier);
+static bool checkInstruction(Verifier* verifier, int offset);
+static bool reach(Verifier* verifier, int offset, int height);
+static bool verifyRegisters(ObjFunction* function, int globalCount);
+static bool checkRegisterInstruction(ObjFunction* function,
+    int globalCount, int offset);
+
+bool verifyFunction(ObjFunction* function, int globalCount,
+    bool registers) {
+  Chunk* chunk = &function->chunk;
+  if (function->arity < 0 || function->arity >= FRAME_SLOTS ||
+      function->upvalueCount < 0 || function->upvalueCount > UINT8_COUNT)
+    return false;
+
+  // A deferred body is compiled from source on its first call
+  if (function->lazySource != NULL)
+    return !registers && chunk->code.size == 0;
+
+  // getLine() needs a run for any offset that can fail
+  if (chunk->code.size == 0 || chunk->lines.size == 0) return false;
+  if (registers) return verifyRegisters(function, globalCount);
+
+  int size = chunk->code.size;
+  Verifier verifier = { function, globalCount,
+    calloc(size, sizeof(bool)), malloc(size * sizeof(int)),
+    malloc(size * sizeof(int)), 0 };
+
+  bool ok = true;
+  for (int offset = 0; offset < size && ok; ) {
+    int length = instructionLength(chunk, offset);
+    ok = length > 0 && length <= size - offset &&
+      checkOperands(&verifier, offset);
+    verifier.starts[offset] = true;
+    offset += length;
+  }
+  if (ok) ok = checkFlow(&verifier);
+
+  free(verifier.starts);
+  free(verifier.heights);
+  free(verifier.pending);
+  return ok;
+}
+
+// Register code has no upvalue instructions, so it never reads them
+bool readsUpvalues(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  for (int offset = 0; offset < chunk->code.size; ) {
+    int length = instructionLength(chunk, offset);
+    if (length <= 0) return false;
+
+    uint8_t* code = &chunk->code.data[offset];
+    if (code[0] == OP_GET_UPVALUE || code[0] == OP_SET_UPVALUE)
+      return true;
+    if (code[0] == OP_CLOSURE || code[0] == OP_CLOSURE_LONG) {
+      int pairs = code[0] == OP_CLOSURE ? 2 : 3;
+      for (int i = pairs; i < length; i += 2)
+        if (!code[i]) return true;
+    }
+    offset += length;
+  }
+  return false;
+}
+
+// Returns -1 for anything that isn't a stack VM instruction. The
+// bytes it reads may lie past the chunk's end; the caller checks.
+static int instructionLength(Chunk* chunk, int offset) {
+  uint8_t* code = &chunk->code.data[offset];
+  int remaining = chunk->code.size - offset;
+  switch (code[0]) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_PRINT:
+    case OP_POP:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_NOT_EQUAL:
+    case OP_LESS_EQUAL:
+    case OP_GREATER_EQUAL:
+      return 1;
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_OUTER:
+    case OP_SET_OUTER:
+    case OP_CALL:
+    case OP_SET_LOCAL_POP:
+    case OP_ADD_CONSTANT:
+      return 2;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_CONSTANT_LONG:
+    case OP_GET_LOCAL_2:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_INT:
+    case OP_ADD_INT:
+    case OP_SUBTRACT_INT:
+    case OP_EQUAL_INT:
+    case OP_LESS_INT:
+    case OP_GREATER_INT:
+      return 3;
+    case OP_JUMP_IF_NOT_LESS_INT:
+      return 5;
+    case OP_CLOSURE:
+    case OP_SHARED_CLOSURE:
+    case OP_CLOSURE_LONG: {
+      // The upvalue operands depend on the function
+      int length = code[0] == OP_CLOSURE_LONG ? 3 : 2;
+      if (remaining < length) return -1;
+      int constant = length == 2 ? code[1] : (code[1] << 8) | code[2];
+      if (constant >= chunk->constants.size) return -1;
+
+      Value value = chunk->constants.data[constant];
+      ObjFunction* function;
+      if (code[0] == OP_SHARED_CLOSURE && IS_CLOSURE(value))
+        function = AS_CLOSURE(value)->function;
+      else if (code[0] != OP_SHARED_CLOSURE && IS_FUNCTION(value))
+        function = AS_FUNCTION(value);
+      else
+        return -1;
+      return length + 2 * function->upvalueCount;
+    }
+    default:
+      return -1;
+  }
+}
+
+// Checks what doesn't depend on the stack height. The whole
+// instruction is known to be inside the chunk.
+static bool checkOperands(Verifier* verifier, int offset) {
+  ObjFunction* function = verifier->function;
+  Chunk* chunk = &function->chunk;
+  uint8_t* code = &chunk->code.data[offset];
+#define WIDE_OPERAND ((code[1] << 8) | code[2])
+
+  switch (code[0]) {
+    case OP_CONSTANT:
+    case OP_ADD_CONSTANT:
+      return code[1] < chunk->constants.size;
+    case OP_CONSTANT_LONG:
+      return WIDE_OPERAND < chunk->constants.size;
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+      return code[1] < function->upvalueCount;
+    // These reach into the frame below, so the script, which runs
+    // in the bottom frame, can't use them
+    case OP_GET_OUTER:
+    case OP_SET_OUTER:
+      return function->name != NULL;
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+      return WIDE_OPERAND < verifier->globalCount;
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG: {
+      int length = instructionLength(chunk, offset);
+      for (int i = code[0] == OP_CLOSURE ? 2 : 3; i < length; i += 2) {
+        if (code[i] > 1) return false;
+        // Captured locals are checked against the stack height
+        if (!code[i] && code[i + 1] >= function->upvalueCount)
+          return false;
+      }
+      return true;
+    }
+    default:
+      return true;
+  }
+#undef WIDE_OPERAND
+}
+
+// Follows every path from the function's entry, where the callee and
+// its arguments are on the stack
+static bool checkFlow(Verifier* verifier) {
+  int size = verifier->function->chunk.code.size;
+  for (int i = 0; i < size; i++) verifier->heights[i] = -1;
+
+  if (!reach(verifier, 0, verifier->function->arity + 1)) return false;
+  while (verifier->pendingCount > 0) {
+    int offset = verifier->pending[--verifier->pendingCount];
+    if (!checkInstruction(verifier, offset)) return false;
+  }
+  return true;
+}
+
+static bool checkInstruction(Verifier* verifier, int offset) {
+  Chunk* chunk = &verifier->function->chunk;
+  uint8_t* code = &chunk->code.data[offset];
+  int height = verifier->heights[offset];
+  int next = offset + instructionLength(chunk, offset);
+  // Jump offsets are the instruction's last two bytes, counted from
+  // the next instruction
+  int distance = next - offset < 3 ? 0
+    : (chunk->code.data[next - 2] << 8) | chunk->code.data[next - 1];
+  int jump = next + distance;
+
+  int needs = 0, effect = 0;
+  switch (code[0]) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_INT:
+    case OP_GET_UPVALUE:
+    case OP_GET_OUTER:
+    case OP_GET_GLOBAL:
+      effect = 1;
+      break;
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_NOT_EQUAL:
+    case OP_LESS_EQUAL:
+    case OP_GREATER_EQUAL:
+      needs = 2;
+      effect = -1;
+      break;
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_ADD_CONSTANT:
+    case OP_ADD_INT:
+    case OP_SUBTRACT_INT:
+    case OP_EQUAL_INT:
+    case OP_LESS_INT:
+    case OP_GREATER_INT:
+    case OP_SET_UPVALUE:
+    case OP_SET_OUTER:
+    case OP_SET_GLOBAL:
+      needs = 1;
+      break;
+    case OP_PRINT:
+    case OP_POP:
+    case OP_CLOSE_UPVALUE:
+    case OP_DEFINE_GLOBAL:
+      needs = 1;
+      effect = -1;
+      break;
+    case OP_GET_LOCAL:
+      if (code[1] >= height) return false;
+      effect = 1;
+      break;
+    // The second read may be of the value the first one pushed
+    case OP_GET_LOCAL_2:
+      if (code[1] >= height || code[2] > height) return false;
+      effect = 2;
+      break;
+    case OP_SET_LOCAL:
+      if (code[1] >= height) return false;
+      needs = 1;
+      break;
+    case OP_SET_LOCAL_POP:
+      if (code[1] >= height) return false;
+      needs = 1;
+      effect = -1;
+      break;
+    case OP_CALL:
+      needs = code[1] + 1;
+      effect = -code[1];
+      break;
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+      // The closure is pushed before it captures, so a function can
+      // capture itself
+      for (int i = code[0] == OP_CLOSURE ? 2 : 3; i < next - offset; i += 2)
+        if (code[i] && code[i + 1] > height) return false;
+      effect = 1;
+      break;
+    case OP_SHARED_CLOSURE:
+      effect = 1;
+      break;
+    case OP_RETURN:
+      return height >= 1;
+    case OP_JUMP:
+      return reach(verifier, jump, height);
+    case OP_LOOP:
+      return reach(verifier, next - distance, height);
+    case OP_JUMP_IF_FALSE:
+      return height >= 1 && reach(verifier, jump, height) &&
+        reach(verifier, next, height);
+    case OP_POP_JUMP_IF_FALSE:
+      return height >= 1 && reach(verifier, jump, height - 1) &&
+        reach(verifier, next, height - 1);
+    case OP_JUMP_IF_NOT_LESS:
+      return height >= 2 && reach(verifier, jump, height - 2) &&
+        reach(verifier, next, height - 2);
+    case OP_JUMP_IF_NOT_LESS_INT:
+      return height >= 1 && reach(verifier, jump, height - 1) &&
+        reach(verifier, next, height - 1);
+  }
+
+  return height >= needs && reach(verifier, next, height + effect);
+}
+
+// Records the height an instruction is reached with; every path to it
+// must agree
+static bool reach(Verifier* verifier, int offset, int height) {
+  if (offset < 0 || offset >= verifier->function->chunk.code.size ||
+      !verifier->starts[offset] || height > FRAME_SLOTS)
+    return false;
+
+  if (verifier->heights[offset] == -1) {
+    verifier->heights[offset] = height;
+    verifier->pending[verifier->pendingCount++] = offset;
+    return true;
+  }
+  return verifier->heights[offset] == height;
+}
+
+// Register instructions are fixed size and only name registers below
+// registerCount, so there is no height to follow
+static bool verifyRegisters(ObjFunction* function, int globalCount) {
+  Chunk* chunk = &function->chunk;
+  if (function->registerCount <= function->arity ||
+      function->registerCount > UINT8_COUNT ||
+      chunk->code.size % 4 != 0)
+    return false;
+
+  for (int offset = 0; offset < chunk->code.size; offset += 4)
+    if (!checkRegisterInstruction(function, globalCount, offset))
+      return false;
+  return true;
+}
+
+static bool checkRegisterInstruction(ObjFunction* function,
+    int globalCount, int offset) {
+  Chunk* chunk = &function->chunk;
+  uint8_t* code = &chunk->code.data[offset];
+  int registers = function->registerCount;
+  int constants = chunk->constants.size;
+  int a = code[1], b = code[2], c = code[3];
+  int bx = (b << 8) | c;
+  int next = offset + 4;
+  int target = next + (int16_t) bx;
+  bool jumps = target >= 0 && target < chunk->code.size;
+
+  // Only a return or a jump may end the chunk
+  if (code[0] != OP_REG_RETURN && code[0] != OP_REG_JUMP &&
+      next >= chunk->code.size)
+    return false;
+
+  switch (code[0]) {
+    case OP_REG_LOAD_NIL:
+    case OP_REG_LOAD_TRUE:
+    case OP_REG_LOAD_FALSE:
+    case OP_REG_PRINT:
+    case OP_REG_RETURN:
+      return a < registers;
+    case OP_REG_MOVE:
+    case OP_REG_NOT:
+    case OP_REG_NEGATE:
+      return a < registers && b < registers;
+    case OP_REG_LOAD_CONSTANT:
+      return a < registers && bx < constants;
+    case OP_REG_CLOSURE:
+      return a < registers && bx < constants &&
+        IS_FUNCTION(chunk->constants.data[bx]);
+    case OP_REG_DEFINE_GLOBAL:
+    case OP_REG_GET_GLOBAL:
+    case OP_REG_SET_GLOBAL:
+      return a < registers && bx < globalCount;
+    case OP_REG_ADD:
+    case OP_REG_SUBTRACT:
+    case OP_REG_MULTIPLY:
+    case OP_REG_DIVIDE:
+    case OP_REG_EQUAL:
+    case OP_REG_NOT_EQUAL:
+    case OP_REG_LESS:
+    case OP_REG_LESS_EQUAL:
+    case OP_REG_GREATER:
+    case OP_REG_GREATER_EQUAL:
+      return a < registers && b < registers && c < registers;
+    case OP_REG_ADD_CONST:
+    case OP_REG_SUBTRACT_CONST:
+    case OP_REG_MULTIPLY_CONST:
+    case OP_REG_DIVIDE_CONST:
+    case OP_REG_EQUAL_CONST:
+    case OP_REG_NOT_EQUAL_CONST:
+    case OP_REG_LESS_CONST:
+    case OP_REG_LESS_EQUAL_CONST:
+    case OP_REG_GREATER_CONST:
+    case OP_REG_GREATER_EQUAL_CONST:
+      return a < registers && b < registers && c < constants;
+    // The callee and its arguments are R[A] through R[A+B]
+    case OP_REG_CALL:
+      return a + b < registers;
+    case OP_REG_JUMP:
+      return jumps && target % 4 == 0;
+    case OP_REG_JUMP_IF_FALSE:
+    case OP_REG_JUMP_IF_TRUE:
+      return a < registers && jumps && target % 4 == 0;
+    default:
+      return false;
+  }
+}
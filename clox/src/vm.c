@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <time.h>
 #include "vm.h"
 #include "value.h"
@@ -7,6 +8,7 @@
 #include "compiler.h"
 #include "chunk.h"
 #include "object.h"
+#include "profile.h"
 
 
 static VM vm;
@@ -14,42 +16,109 @@ static VM vm;
 
 static InterpretResult run(void);
 static Value peek(int distance);
-static void runtimeError(const char* format, ...);
 static void resetStack(void);
-static bool isFalsey(Value);
 static void concatenate(void);
 static bool callValue(Value callee, int argCount);
 static bool call(ObjClosure* function, int argCount);
+static void pushClosure(CallFrame* frame, ObjFunction* function);
+static ObjUpvalue* captureUpvalue(Value* local);
+static void closeUpvalues(Value* last);
 static void defineNative(const char* name, NativeFn function);
+static void traceInstruction(CallFrame* frame);
 
 static Value clockNative(int, Value*);
 
+// Every native the VM defines. Images refer to natives by name, since
+// their addresses change from run to run.
+typedef struct {
+  const char* name;
+  NativeFn function;
+} NativeEntry;
+
+static const NativeEntry natives[] = {
+  { "clock", clockNative },
+};
+
+#define NATIVE_COUNT ((int) (sizeof(natives) / sizeof(natives[0])))
+
 void initVM(void) {
   resetStack();
   vm.objects = NULL;
+  vm.bytesAllocated = 0;
+  vm.nextGC = GC_INITIAL_THRESHOLD;
+  init_GrayStack(&vm.grayStack);
+  initPools();
+#ifdef GC_GENERATIONAL
+  vm.nursery = NULL;
+  vm.nurseryBytes = 0;
+  vm.nurseryLimit = GC_NURSERY_INITIAL;
+  vm.oldBytes = 0;
+  vm.gcPauseBudget = GC_DEFAULT_PAUSE_BUDGET_NS;
+  init_GrayStack(&vm.rememberedSet);
+#endif
+  memset(&vm.gcStats, 0, sizeof(vm.gcStats));
+  vm.printCode = false;
+  vm.traceExecution = false;
+  vm.lazyFunctions = false;
   init_Table(&vm.strings);
-  init_Table(&vm.globals);
+  init_Table(&vm.globalSlots);
+  init_ValueArray(&vm.globalValues);
+  init_ValueArray(&vm.globalNames);
 
-  defineNative("clock", clockNative);
+  for (int i = 0; i < NATIVE_COUNT; i++)
+    defineNative(natives[i].name, natives[i].function);
 }
 
 void freeVM(void) {
-  free_Table(&vm.globals);
+  free_Table(&vm.globalSlots);
+  free_ValueArray(&vm.globalValues);
+  free_ValueArray(&vm.globalNames);
   free_Table(&vm.strings);
   freeObjects();
 }
 
 VM* get_VM(void) { return &vm; }
 
+// Returns the slot for a global, allocating an undefined one the
+// first time a name is seen
+int globalSlot(ObjString* name) {
+  Value slot;
+  if (tableGet(&vm.globalSlots, name, &slot))
+    return (int) AS_NUMBER(slot);
+
+  push_back_ValueArray(&vm.globalValues, UNDEFINED_VAL);
+  push_back_ValueArray(&vm.globalNames, OBJ_VAL(name));
+  tableSet(&vm.globalSlots, name, NUMBER_VAL(vm.globalValues.size - 1));
+  return vm.globalValues.size - 1;
+}
+
+const char* nativeName(NativeFn function) {
+  for (int i = 0; i < NATIVE_COUNT; i++)
+    if (natives[i].function == function) return natives[i].name;
+  return NULL;
+}
+
+NativeFn findNative(const char* name, int length) {
+  for (int i = 0; i < NATIVE_COUNT; i++)
+    if ((int) strlen(natives[i].name) == length &&
+        memcmp(natives[i].name, name, length) == 0)
+      return natives[i].function;
+  return NULL;
+}
+
 InterpretResult interpret(const char* source) {
   ObjFunction* function = compile(source);
   if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
+  return interpretFunction(function);
+}
+
+InterpretResult interpretFunction(ObjFunction* function) {
   push(OBJ_VAL(function));
   ObjClosure* closure = newClosure(function);
   pop();
   push(OBJ_VAL(closure));
-  call(closure, 0);
+  if (!call(closure, 0)) return INTERPRET_RUNTIME_ERROR;
 
   return run();
 }
@@ -62,6 +131,9 @@ static InterpretResult run(void) {
 #define READ_SHORT() \
   (frame->ip += 2, \
   (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_CONSTANT_LONG() \
+  (frame->closure->function->chunk.constants.data[READ_SHORT()])
+#define READ_INT() ((int16_t) READ_SHORT())
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 #define BINARY_OP(valueType, op) \
   do { \
@@ -73,164 +145,422 @@ static InterpretResult run(void) {
     double a = AS_NUMBER(pop()); \
     push(valueType(a op b)); \
   } while (false)
+// a <= b is !(a > b) and a >= b is !(a < b), which differ from the
+// direct comparisons only for NaN
+#define NEGATED_OP(op) \
+  do { \
+    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+      runtimeError("Operands must be numbers"); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } \
+    double b = AS_NUMBER(pop()); \
+    double a = AS_NUMBER(pop()); \
+    push(BOOL_VAL(!(a op b))); \
+  } while (false)
+// The right operand is the instruction's immediate
+#define INT_OP(valueType, op) \
+  do { \
+    int16_t b = READ_INT(); \
+    if (!IS_NUMBER(peek(0))) { \
+      runtimeError("Operands must be numbers"); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } \
+    vm.stackTop[-1] = valueType(AS_NUMBER(peek(0)) op b); \
+  } while (false)
 
-  for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-    fputs("          ", stdout);
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-      fputs("[ ", stdout);
-      printValue(*slot);
-      fputs(" ]", stdout);
-    }
-    puts("");
+#ifdef PROFILE_OPCODES
+#define PROFILE_INSTRUCTION() profileInstruction(*frame->ip)
+#else
+#define PROFILE_INSTRUCTION() do { } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+  // Labels-as-values dispatch: every handler ends in its own indirect
+  // jump, which gives the branch predictor one slot per opcode
+  // instead of a single shared one at the top of the switch.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#pragma GCC diagnostic ignored "-Woverride-init"
+  static void* dispatchTable[UINT8_MAX + 1] = {
+    [0 ... UINT8_MAX] = &&op_unknown,
+    [OP_CONSTANT]       = &&op_OP_CONSTANT,
+    [OP_NIL]            = &&op_OP_NIL,
+    [OP_TRUE]           = &&op_OP_TRUE,
+    [OP_FALSE]          = &&op_OP_FALSE,
+    [OP_EQUAL]          = &&op_OP_EQUAL,
+    [OP_GREATER]        = &&op_OP_GREATER,
+    [OP_LESS]           = &&op_OP_LESS,
+    [OP_ADD]            = &&op_OP_ADD,
+    [OP_SUBTRACT]       = &&op_OP_SUBTRACT,
+    [OP_MULTIPLY]       = &&op_OP_MULTIPLY,
+    [OP_DIVIDE]         = &&op_OP_DIVIDE,
+    [OP_NOT]            = &&op_OP_NOT,
+    [OP_NEGATE]         = &&op_OP_NEGATE,
+    [OP_PRINT]          = &&op_OP_PRINT,
+    [OP_JUMP]           = &&op_OP_JUMP,
+    [OP_JUMP_IF_FALSE]  = &&op_OP_JUMP_IF_FALSE,
+    [OP_LOOP]           = &&op_OP_LOOP,
+    [OP_POP]            = &&op_OP_POP,
+    [OP_GET_LOCAL]      = &&op_OP_GET_LOCAL,
+    [OP_SET_LOCAL]      = &&op_OP_SET_LOCAL,
+    [OP_GET_UPVALUE]    = &&op_OP_GET_UPVALUE,
+    [OP_SET_UPVALUE]    = &&op_OP_SET_UPVALUE,
+    [OP_CLOSE_UPVALUE]  = &&op_OP_CLOSE_UPVALUE,
+    [OP_DEFINE_GLOBAL]  = &&op_OP_DEFINE_GLOBAL,
+    [OP_GET_GLOBAL]     = &&op_OP_GET_GLOBAL,
+    [OP_SET_GLOBAL]     = &&op_OP_SET_GLOBAL,
+    [OP_RETURN]         = &&op_OP_RETURN,
+    [OP_CLOSURE]        = &&op_OP_CLOSURE,
+    [OP_CALL]           = &&op_OP_CALL,
+    [OP_CONSTANT_LONG]  = &&op_OP_CONSTANT_LONG,
+    [OP_CLOSURE_LONG]   = &&op_OP_CLOSURE_LONG,
+    [OP_SHARED_CLOSURE] = &&op_OP_SHARED_CLOSURE,
+    [OP_GET_OUTER]      = &&op_OP_GET_OUTER,
+    [OP_SET_OUTER]      = &&op_OP_SET_OUTER,
+    [OP_GET_LOCAL_2]    = &&op_OP_GET_LOCAL_2,
+    [OP_SET_LOCAL_POP]  = &&op_OP_SET_LOCAL_POP,
+    [OP_ADD_CONSTANT]   = &&op_OP_ADD_CONSTANT,
+    [OP_NOT_EQUAL]      = &&op_OP_NOT_EQUAL,
+    [OP_LESS_EQUAL]     = &&op_OP_LESS_EQUAL,
+    [OP_GREATER_EQUAL]  = &&op_OP_GREATER_EQUAL,
+    [OP_POP_JUMP_IF_FALSE] = &&op_OP_POP_JUMP_IF_FALSE,
+    [OP_JUMP_IF_NOT_LESS]  = &&op_OP_JUMP_IF_NOT_LESS,
+    [OP_INT]            = &&op_OP_INT,
+    [OP_ADD_INT]        = &&op_OP_ADD_INT,
+    [OP_SUBTRACT_INT]   = &&op_OP_SUBTRACT_INT,
+    [OP_EQUAL_INT]      = &&op_OP_EQUAL_INT,
+    [OP_LESS_INT]       = &&op_OP_LESS_INT,
+    [OP_GREATER_INT]    = &&op_OP_GREATER_INT,
+    [OP_JUMP_IF_NOT_LESS_INT] = &&op_OP_JUMP_IF_NOT_LESS_INT,
+  };
+  // --trace routes every opcode through op_trace first, so the
+  // untraced loop pays nothing for it
+  static void* traceTable[UINT8_MAX + 1] = { [0 ... UINT8_MAX] = &&op_trace };
+  void** dispatch = vm.traceExecution ? traceTable : dispatchTable;
+#define INTERPRET_LOOP  DISPATCH();
+#define CASE(op)        op_##op
+#define DEFAULT         op_unknown
+#define DISPATCH() \
+  do { \
+    PROFILE_INSTRUCTION(); \
+    goto *dispatch[READ_BYTE()]; \
+  } while (false)
+#else
+  bool trace = vm.traceExecution;
+#define INTERPRET_LOOP \
+  loop: \
+    if (trace) traceInstruction(frame); \
+    PROFILE_INSTRUCTION(); \
+    switch (READ_BYTE())
+#define CASE(op)        case op
+#define DEFAULT         default
+#define DISPATCH()      goto loop
+#endif
 
-    disassembleInstruction(&frame->closure->function->chunk,
-        (int) (frame->ip - frame->closure->function->chunk.code.data));
+#ifdef PROFILE_OPCODES
+  profileBegin();
 #endif
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-      case OP_CLOSURE: {
-        ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-        ObjClosure* closure = newClosure(function);
-        push(OBJ_VAL(closure));
-        break;
-      } 
-      case OP_RETURN: {
-        Value result = pop();
-        vm.frameCount--;
-        if (vm.frameCount == 0) {
-          pop();
-          return INTERPRET_OK;
-        }
-
-        vm.stackTop = frame->slots;
-        push(result);
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
-      }
-      case OP_CALL: {
-        int argCount = READ_BYTE();
-        if (!callValue(peek(argCount), argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
-      }
-      case OP_PRINT: {
-        printValue(pop());
-        puts("");
-        break;
-      }
-      case OP_POP: {
+  INTERPRET_LOOP
+  {
+    CASE(OP_CLOSURE):
+      pushClosure(frame, AS_FUNCTION(READ_CONSTANT()));
+      DISPATCH();
+    CASE(OP_CLOSURE_LONG):
+      pushClosure(frame, AS_FUNCTION(READ_CONSTANT_LONG()));
+      DISPATCH();
+    CASE(OP_SHARED_CLOSURE): {
+      ObjClosure* closure = AS_CLOSURE(READ_CONSTANT());
+      frame->ip += 2 * closure->function->upvalueCount;
+      push(OBJ_VAL(closure));
+      DISPATCH();
+    }
+    // Only emitted in functions that are always called from the frame
+    // that declared them. The slot is checked against the caller's
+    // values anyway, since loaded code can't be held to that.
+    CASE(OP_GET_OUTER): {
+      Value* slot = frame[-1].slots + READ_BYTE();
+      if (slot >= frame->slots) goto outer_error;
+      push(*slot);
+      DISPATCH();
+    }
+    CASE(OP_SET_OUTER): {
+      Value* slot = frame[-1].slots + READ_BYTE();
+      if (slot >= frame->slots) goto outer_error;
+      *slot = peek(0);
+      DISPATCH();
+    }
+    CASE(OP_GET_UPVALUE): {
+      uint8_t slot = READ_BYTE();
+      push(*frame->closure->upvalues[slot]->location);
+      DISPATCH();
+    }
+    CASE(OP_SET_UPVALUE): {
+      ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+      *upvalue->location = peek(0);
+      WRITE_BARRIER(&upvalue->obj, peek(0));
+      DISPATCH();
+    }
+    CASE(OP_CLOSE_UPVALUE):
+      closeUpvalues(vm.stackTop - 1);
+      pop();
+      DISPATCH();
+    CASE(OP_RETURN): {
+      Value result = pop();
+      closeUpvalues(frame->slots);
+      vm.frameCount--;
+      if (vm.frameCount == 0) {
         pop();
-        break;
-      }
-      case OP_JUMP: {
-        uint16_t offset = READ_SHORT();
-        frame->ip += offset;
-        break;
-      }
-      case OP_JUMP_IF_FALSE: {
-        uint16_t offset = READ_SHORT();
-        if (isFalsey(peek(0))) frame->ip += offset;
-        break;
+        return INTERPRET_OK;
       }
-      case OP_LOOP: {
-        uint16_t offset = READ_SHORT();
-        frame->ip -= offset;
-        break;
+
+      vm.stackTop = frame->slots;
+      push(result);
+      frame = &vm.frames[vm.frameCount - 1];
+      DISPATCH();
+    }
+    CASE(OP_CALL): {
+      int argCount = READ_BYTE();
+      if (!callValue(peek(argCount), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_GET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        push(frame->slots[slot]);
-        break;
+      frame = &vm.frames[vm.frameCount - 1];
+      DISPATCH();
+    }
+    CASE(OP_PRINT): {
+      printValue(pop());
+      puts("");
+      DISPATCH();
+    }
+    CASE(OP_POP): {
+      pop();
+      DISPATCH();
+    }
+    CASE(OP_JUMP): {
+      uint16_t offset = READ_SHORT();
+      frame->ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_FALSE): {
+      uint16_t offset = READ_SHORT();
+      if (isFalsey(peek(0))) frame->ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_POP_JUMP_IF_FALSE): {
+      uint16_t offset = READ_SHORT();
+      if (isFalsey(pop())) frame->ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_LESS): {
+      uint16_t offset = READ_SHORT();
+      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+        runtimeError("Operands must be numbers");
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_SET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        frame->slots[slot] = peek(0);
-        break;
+      double b = AS_NUMBER(pop());
+      double a = AS_NUMBER(pop());
+      if (!(a < b)) frame->ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_LESS_INT): {
+      int16_t b = READ_INT();
+      uint16_t offset = READ_SHORT();
+      if (!IS_NUMBER(peek(0))) {
+        runtimeError("Operands must be numbers");
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_DEFINE_GLOBAL: {
-        ObjString* name = READ_STRING();
-        tableSet(&vm.globals, name, peek(0));
-        pop();
-        break;
+      if (!(AS_NUMBER(pop()) < b)) frame->ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_LOOP): {
+      uint16_t offset = READ_SHORT();
+      frame->ip -= offset;
+      DISPATCH();
+    }
+    CASE(OP_GET_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      push(frame->slots[slot]);
+      DISPATCH();
+    }
+    CASE(OP_SET_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      frame->slots[slot] = peek(0);
+      DISPATCH();
+    }
+    CASE(OP_GET_LOCAL_2): {
+      uint8_t first = READ_BYTE();
+      uint8_t second = READ_BYTE();
+      push(frame->slots[first]);
+      push(frame->slots[second]);
+      DISPATCH();
+    }
+    CASE(OP_SET_LOCAL_POP): {
+      uint8_t slot = READ_BYTE();
+      frame->slots[slot] = pop();
+      DISPATCH();
+    }
+    CASE(OP_DEFINE_GLOBAL): {
+      vm.globalValues.data[READ_SHORT()] = pop();
+      DISPATCH();
+    }
+    CASE(OP_SET_GLOBAL): {
+      uint16_t slot = READ_SHORT();
+      if (IS_UNDEFINED(vm.globalValues.data[slot])) {
+        runtimeError("Undefined variable '%s'",
+            AS_CSTRING(vm.globalNames.data[slot]));
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_SET_GLOBAL: {
-        ObjString* name = READ_STRING();
-        if(tableSet(&vm.globals, name, peek(0))) {
-          tableDelete(&vm.globals, name);
-          runtimeError("Undefined variable '%s'", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+      vm.globalValues.data[slot] = peek(0);
+      DISPATCH();
+    }
+    CASE(OP_GET_GLOBAL): {
+      uint16_t slot = READ_SHORT();
+      Value value = vm.globalValues.data[slot];
+      if (IS_UNDEFINED(value)) {
+        runtimeError("Undefined variable '%s'",
+            AS_CSTRING(vm.globalNames.data[slot]));
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_GET_GLOBAL: {
-        ObjString* name = READ_STRING();
-        Value value;
-        if (!tableGet(&vm.globals, name, &value)) {
-          runtimeError("Undefined variable '%s'", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(value);
-        break;
+      push(value);
+      DISPATCH();
+    }
+    CASE(OP_CONSTANT): {
+      Value constant = READ_CONSTANT();
+      push(constant);
+      DISPATCH();
+    }
+    CASE(OP_CONSTANT_LONG): {
+      Value constant = READ_CONSTANT_LONG();
+      push(constant);
+      DISPATCH();
+    }
+    CASE(OP_NIL): push(NIL_VAL); DISPATCH();
+    CASE(OP_TRUE): push(BOOL_VAL(true)); DISPATCH();
+    CASE(OP_FALSE): push(BOOL_VAL(false)); DISPATCH();
+    CASE(OP_NOT):
+      push(BOOL_VAL(isFalsey(pop())));
+      DISPATCH();
+    CASE(OP_NEGATE):
+      if (!IS_NUMBER(peek(0))) {
+        runtimeError("Operand must be a number");
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_CONSTANT: {
-        Value constant = READ_CONSTANT();
-        push(constant);
-        break;
+      push(NUMBER_VAL(-AS_NUMBER(pop())));
+      DISPATCH();
+    CASE(OP_EQUAL): {
+      Value b = pop();
+      Value a = pop();
+      push(BOOL_VAL(valuesEqual(a, b)));
+      DISPATCH();
+    }
+    CASE(OP_NOT_EQUAL): {
+      Value b = pop();
+      Value a = pop();
+      push(BOOL_VAL(!valuesEqual(a, b)));
+      DISPATCH();
+    }
+    CASE(OP_GREATER):  BINARY_OP(BOOL_VAL,   >); DISPATCH();
+    CASE(OP_LESS):     BINARY_OP(BOOL_VAL,   <); DISPATCH();
+    CASE(OP_LESS_EQUAL):    NEGATED_OP(>); DISPATCH();
+    CASE(OP_GREATER_EQUAL): NEGATED_OP(<); DISPATCH();
+    CASE(OP_ADD_CONSTANT): {
+      Value constant = READ_CONSTANT();
+      if (IS_NUMBER(peek(0)) && IS_NUMBER(constant)) {
+        vm.stackTop[-1] =
+          NUMBER_VAL(AS_NUMBER(peek(0)) + AS_NUMBER(constant));
+        DISPATCH();
       }
-      case OP_NIL: push(NIL_VAL); break;
-      case OP_TRUE: push(BOOL_VAL(true)); break;
-      case OP_FALSE: push(BOOL_VAL(false)); break;
-      case OP_NOT:
-        push(BOOL_VAL(isFalsey(pop())));
-        break;
-      case OP_NEGATE:
-        if (!IS_NUMBER(peek(0))) {
-          runtimeError("Operand must be a number");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(NUMBER_VAL(-AS_NUMBER(pop())));
-        break;
-      case OP_EQUAL: {
-        Value b = pop();
-        Value a = pop();
-        push(BOOL_VAL(valuesEqual(a, b)));
-        break;
+      // Strings and errors take the OP_ADD path
+      push(constant);
+      goto add;
+    }
+    CASE(OP_ADD): add: {
+      if (IS_TEXT(peek(0)) && IS_TEXT(peek(1))) {
+        concatenate();
+      } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+        double b = AS_NUMBER(pop());
+        double a = AS_NUMBER(pop());
+        push(NUMBER_VAL(a + b));
+      } else {
+        runtimeError(
+            "Operands must be two numbers or two strings");
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_GREATER:  BINARY_OP(BOOL_VAL,   >); break;
-      case OP_LESS:     BINARY_OP(BOOL_VAL,   <); break;
-      case OP_ADD: {
-        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-          concatenate();
-        } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-          double b = AS_NUMBER(pop());
-          double a = AS_NUMBER(pop());
-          push(NUMBER_VAL(a + b));
-        } else {
-          runtimeError(
-              "Operands must be two numbers or two strings");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+      DISPATCH();
+    }
+    CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+    CASE(OP_INT): push(NUMBER_VAL(READ_INT())); DISPATCH();
+    CASE(OP_ADD_INT): {
+      int16_t b = READ_INT();
+      if (IS_NUMBER(peek(0))) {
+        vm.stackTop[-1] = NUMBER_VAL(AS_NUMBER(peek(0)) + b);
+        DISPATCH();
       }
-      case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-      case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-      case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
+      // Let OP_ADD report the error
+      push(NUMBER_VAL(b));
+      goto add;
+    }
+    CASE(OP_SUBTRACT_INT):  INT_OP(NUMBER_VAL, -); DISPATCH();
+    CASE(OP_LESS_INT):      INT_OP(BOOL_VAL,   <); DISPATCH();
+    CASE(OP_GREATER_INT):   INT_OP(BOOL_VAL,   >); DISPATCH();
+    CASE(OP_EQUAL_INT): {
+      int16_t b = READ_INT();
+      vm.stackTop[-1] =
+        BOOL_VAL(IS_NUMBER(peek(0)) && AS_NUMBER(peek(0)) == b);
+      DISPATCH();
     }
+    CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+    CASE(OP_DIVIDE):   BINARY_OP(NUMBER_VAL, /); DISPATCH();
+    DEFAULT:
+      runtimeError("Unknown opcode %d", frame->ip[-1]);
+      return INTERPRET_RUNTIME_ERROR;
+    outer_error:
+      runtimeError("Outer variable slot out of range");
+      return INTERPRET_RUNTIME_ERROR;
+#ifdef COMPUTED_GOTO
+    op_trace:
+      frame->ip--;
+      traceInstruction(frame);
+      goto *dispatchTable[READ_BYTE()];
+#endif
   }
 
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
 #undef READ_BYTE
 #undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
 #undef READ_SHORT
+#undef READ_INT
 #undef READ_STRING
 #undef BINARY_OP
+#undef NEGATED_OP
+#undef INT_OP
+#undef PROFILE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DEFAULT
+#undef DISPATCH
+}
+
+static void traceInstruction(CallFrame* frame) {
+  fputs("          ", stdout);
+  for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+    fputs("[ ", stdout);
+    printValue(*slot);
+    fputs(" ]", stdout);
+  }
+  puts("");
+
+  disassembleInstruction(&frame->closure->function->chunk,
+      (int) (frame->ip - frame->closure->function->chunk.code.data));
 }
 
 static void resetStack(void) {
   vm.stackTop = vm.stack;
   vm.frameCount = 0;
+  vm.openUpvalues = NULL;
 }
 
 void push(Value value) {
@@ -247,7 +577,7 @@ static Value peek(int distance) {
   return vm.stackTop[-1 - distance];
 }
 
-static void runtimeError(const char* format, ...) {
+void runtimeError(const char* format, ...) {
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
@@ -260,7 +590,7 @@ static void runtimeError(const char* format, ...) {
     size_t instruction = frame->ip 
       - function->chunk.code.data - 1;
     fprintf(stderr, "[line %d] in ",
-        function->chunk.lines.data[instruction]);
+        getLine(&function->chunk, (int) instruction));
     if (function->name == NULL)
       fprintf(stderr, "script\n");
     else
@@ -270,21 +600,13 @@ static void runtimeError(const char* format, ...) {
   resetStack();
 }
 
-static bool isFalsey(Value value) {
-  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
-}
-
 static void concatenate(void) {
-  ObjString* b = AS_STRING(pop());
-  ObjString* a = AS_STRING(pop());
+  Obj* b = AS_OBJ(peek(0));
+  Obj* a = AS_OBJ(peek(1));
 
-  int length = a->length + b->length;
-  char* chars = malloc(length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
-
-  ObjString* result = takeString(chars, length);
+  Obj* result = concatText(a, b);
+  pop();
+  pop();
   push(OBJ_VAL(result));
 }
 
@@ -315,22 +637,82 @@ static bool call(ObjClosure* closure, int argCount) {
     return false;
   }
 
+  if (closure->function->lazySource != NULL &&
+      !compileFunction(closure->function)) {
+    runtimeError("Could not compile %s()", closure->function->name->chars);
+    return false;
+  }
+
   if (vm.frameCount == FRAMES_MAX) {
     runtimeError("Stack overflow");
     return false;
   }
 
-  CallFrame* frame = &vm.frames[vm.frameCount++];
+  CallFrame* frame = &vm.frames[vm.frameCount];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code.data;
   frame->slots = vm.stackTop - argCount - 1;
+  // The sampling profiler's signal handler walks frames up to
+  // frameCount, so only count the frame once it is filled in
+  atomic_signal_fence(memory_order_release);
+  vm.frameCount++;
   return true;
 }
 
+// Creates a closure over the (isLocal, index) upvalue operands that
+// follow the closure instruction, and pushes it
+static void pushClosure(CallFrame* frame, ObjFunction* function) {
+  ObjClosure* closure = newClosure(function);
+  push(OBJ_VAL(closure));
+  for (int i = 0; i < closure->upvalueCount; i++) {
+    uint8_t isLocal = *frame->ip++;
+    uint8_t index = *frame->ip++;
+    ObjUpvalue* upvalue = isLocal
+      ? captureUpvalue(frame->slots + index)
+      : frame->closure->upvalues[index];
+    closure->upvalues[i] = upvalue;
+    // Capturing may have collected and promoted the closure
+    WRITE_BARRIER(&closure->obj, OBJ_VAL(upvalue));
+  }
+}
+
+// Returns the open upvalue for a stack slot, creating it if needed.
+// Closures capturing the same variable share one upvalue.
+static ObjUpvalue* captureUpvalue(Value* local) {
+  ObjUpvalue* previous = NULL;
+  ObjUpvalue* upvalue = vm.openUpvalues;
+  while (upvalue != NULL && upvalue->location > local) {
+    previous = upvalue;
+    upvalue = upvalue->next;
+  }
+  if (upvalue != NULL && upvalue->location == local) return upvalue;
+
+  ObjUpvalue* created = newUpvalue(local);
+  created->next = upvalue;
+  if (previous == NULL)
+    vm.openUpvalues = created;
+  else
+    previous->next = created;
+  return created;
+}
+
+// Moves every variable at or above last off the stack and into its
+// upvalue
+static void closeUpvalues(Value* last) {
+  while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
+    ObjUpvalue* upvalue = vm.openUpvalues;
+    upvalue->closed = *upvalue->location;
+    upvalue->location = &upvalue->closed;
+    WRITE_BARRIER(&upvalue->obj, upvalue->closed);
+    vm.openUpvalues = upvalue->next;
+  }
+}
+
 static void defineNative(const char* name, NativeFn function) {
   push(OBJ_VAL(copyString(name, (int)strlen(name))));
   push(OBJ_VAL(newNative(function)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  int slot = globalSlot(AS_STRING(vm.stack[0]));
+  vm.globalValues.data[slot] = vm.stack[1];
   pop();
   pop();
 }